@@ -5,11 +5,13 @@
 #include <cstdarg>
 #include <cstdio>
 #include <cstdlib>
+#include <functional>
 #include <iostream>
-#include <list>
 #include <map>
+#include <new>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
 enum class TokenKind {
@@ -24,17 +26,44 @@ enum class TokenKind {
     TK_EOF,      // 入力の終わりを表すトークン
 };
 
+// 入力されたプログラム
+// ファイルはmmapしたページを、文字列は自分で持っているバッファを指す
+class Source {
+  public:
+    static Source from_string(std::string s);
+    // ファイルから読む。"-"なら標準入力から読む
+    static Source from_file(const std::string &path);
+
+    Source(Source &&other) noexcept;
+    Source(const Source &) = delete;
+    Source &operator=(const Source &) = delete;
+    ~Source();
+
+    std::string_view text() const { return view; }
+
+  private:
+    Source() = default;
+    static Source from_fd(int fd);
+
+    std::string buf;
+    void *map = nullptr;
+    size_t map_len = 0;
+    std::string_view view;
+};
+
+// トークンの文字列はソースコードを指すだけでコピーしない
+// そのためソースコードはトークンより長く生きている必要がある
 struct Token {
-    TokenKind kind;  // トークンの型
-    int val;         // kindがTK_NUMの場合、その数値
-    std::string str; // トークン文字列
+    TokenKind kind;       // トークンの型
+    int val;              // kindがTK_NUMの場合、その数値
+    std::string_view str; // トークン文字列
 
     std::string to_string() const {
         switch (kind) {
         case TokenKind::TK_RESERVED:
-            return "RESERVED: " + str;
+            return "RESERVED: " + std::string(str);
         case TokenKind::TK_IDENT:
-            return "IDENT: " + str;
+            return "IDENT: " + std::string(str);
         case TokenKind::TK_NUM:
             return "NUM: " + std::to_string(val);
         case TokenKind::TK_RETURN:
@@ -55,30 +84,102 @@ struct Token {
     }
 };
 
+// 連続した配列に並べたトークン列と、次に読むトークンの位置
+// 最後は必ずTK_EOFなので、末尾を越えて読むことはない
+struct TokenStream {
+    std::vector<Token> tokens;
+    size_t pos = 0;
+
+    const Token &peek() const { return tokens[pos]; }
+    void next() { pos++; }
+};
+
 // エラーを報告するための関数
 // printfと同じ引数を取る
 void error(const char *fmt, ...);
 
 // 次のトークンが期待している記号のときには、トークンを1つ読み進めて
 // 真を返す。それ以外の場合には偽を返す。
-bool consume(std::list<Token> &tokens, const std::string &op);
+bool consume(TokenStream &tokens, std::string_view op);
 
-std::optional<Token> consume_ident(std::list<Token> &tokens);
+// 次のトークンが識別子のときには、トークンを1つ読み進めてそのトークンを返す。
+// それ以外の場合にはnullptrを返す。
+const Token *consume_ident(TokenStream &tokens);
 
-bool consume_keyword(std::list<Token> &tokens, TokenKind kind);
+bool consume_keyword(TokenStream &tokens, TokenKind kind);
 
 // 次のトークンが期待している記号のときには、トークンを1つ読み進める。
 // それ以外の場合にはエラーを報告する。
-void expect(std::list<Token> &tokens, const std::string &op);
+void expect(TokenStream &tokens, std::string_view op);
 
 // 次のトークンが数値の場合、トークンを1つ読み進めてその数値を返す。
 // それ以外の場合にはエラーを報告する
-int expect_number(std::list<Token> &tokens);
+int expect_number(TokenStream &tokens);
 
 // expect_numberのident版
-std::string expect_ident(std::list<Token> &tokens);
+std::string_view expect_ident(TokenStream &tokens);
+
+TokenStream tokenize(std::string_view s);
+
+// 1回のコンパイルで使うノードなどをまとめて確保し、まとめて解放するためのアリーナ
+// 確保したオブジェクトのデストラクタは呼ばれない
+class Arena {
+  public:
+    Arena() = default;
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+    ~Arena() { release(); }
+
+    void *alloc(size_t size, size_t align);
+
+    template <class T, class... Args> T *make(Args &&... args) {
+        return new (alloc(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    // 文字列をアリーナにコピーする
+    std::string_view strdup(std::string_view s);
+
+    // 確保したメモリをすべて解放する
+    void release();
+
+    size_t used() const { return used_; }
+    size_t peak() const { return peak_; }
+    size_t reserved() const { return reserved_; }
 
-std::list<Token> tokenize(const std::string &s);
+  private:
+    struct Chunk {
+        Chunk *next;
+        size_t size;
+    };
+
+    Chunk *head = nullptr;
+    char *ptr = nullptr;
+    char *end = nullptr;
+    size_t used_ = 0;
+    size_t peak_ = 0;
+    size_t reserved_ = 0;
+};
+
+// アリーナから確保するstd::vector用のアロケータ
+// 個別の解放はせず、アリーナごとまとめて解放する
+template <class T> struct ArenaAllocator {
+    using value_type = T;
+
+    Arena *arena;
+
+    explicit ArenaAllocator(Arena *arena) : arena(arena) {}
+    template <class U> ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena) {}
+
+    T *allocate(size_t n) { return static_cast<T *>(arena->alloc(n * sizeof(T), alignof(T))); }
+    void deallocate(T *, size_t) {}
+
+    template <class U> bool operator==(const ArenaAllocator<U> &other) const {
+        return arena == other.arena;
+    }
+    template <class U> bool operator!=(const ArenaAllocator<U> &other) const {
+        return arena != other.arena;
+    }
+};
 
 // 抽象構文木のノードの種類
 enum class NodeKind {
@@ -98,10 +199,16 @@ enum class NodeKind {
     ND_FOR,     // "for"
     ND_BLOCK,   // "{ ... }"
     ND_FUNCALL, // Function call
+    ND_COMMA,   // lhs, rhs (lhsの値は捨てる。インライン展開で作る)
     ND_NUM,     // 整数
 };
 
+struct Node;
+
+using NodeVec = std::vector<Node *, ArenaAllocator<Node *>>;
+
 // 抽象構文木のノードの型
+// アリーナで確保するので、デストラクタを持つメンバは置かない
 struct Node {
     NodeKind kind; // ノードの型
     Node *lhs;     // 左辺
@@ -115,13 +222,13 @@ struct Node {
     Node *inc;
 
     // Block
-    std::vector<Node *> *body;
+    NodeVec *body;
 
     // Function call
-    std::string funcname;
+    std::string_view funcname;
 
     // funcallの場合の引数
-    std::vector<Node *> *args;
+    NodeVec *args;
 
     int val;    // kindがND_NUMの場合のみ使う
     int offset; // kindがND_LVARの場合のみ使う
@@ -134,9 +241,469 @@ struct Function {
     int stack_size;
 };
 
-std::vector<Function> program(std::list<Token> &tokens);
+// ゼロ初期化したノードをアリーナから確保する
+Node *alloc_node(Arena &arena, NodeKind kind);
+
+NodeVec *alloc_node_vec(Arena &arena, const std::vector<Node *> &nodes);
+
+std::vector<Function> program(TokenStream &tokens, Arena &arena);
+
+void optimize(std::vector<Function> &prog, Arena &arena);
+
+// 小さい関数の呼び出しを、その関数の本体で置き換える
+void inline_functions(std::vector<Function> &prog, Arena &arena);
+
+// 同時に生きていない変数にスタックの同じ場所を使わせ、stack_sizeを縮める
+void share_slots(Function &fn);
+
+// 引数が定数の純粋な関数の呼び出しを、コンパイル時に計算した値で置き換える
+void eval_pure_calls(std::vector<Function> &prog, Arena &arena);
+
+// 同じ値になる式を1回だけ計算し、2回目以降はその値を入れておいた変数を読む
+void eliminate_common_subexprs(Function &fn, Arena &arena);
+
+// ループの展開、ループ不変式の移動、帰納変数の強さの軽減
+void optimize_loops(Function &fn, Arena &arena);
+
+// 到達しない文、副作用のない式文、後で読まれない変数への代入を消す
+void eliminate_dead_code(Function &fn, Arena &arena);
+
+// -fjitか-fvmで実行するとき、mainから呼ばれない関数を消す
+void remove_unused_functions(std::vector<Function> &prog);
+
+// x86-64の汎用レジスタ。並びは命令エンコーディングでの番号と同じ
+enum class Reg : uint8_t {
+    RAX,
+    RCX,
+    RDX,
+    RBX,
+    RSP,
+    RBP,
+    RSI,
+    RDI,
+    R8,
+    R9,
+    R10,
+    R11,
+    R12,
+    R13,
+    R14,
+    R15,
+};
+
+const char *reg_name(Reg reg);
+
+// 命令のオペランド (レジスタ、即値、[base+index*scale+disp]のメモリ)
+struct Operand {
+    enum Kind : uint8_t { NONE, REG, IMM, MEM };
+
+    Kind kind;
+    Reg reg;           // REGのレジスタ、MEMのベースレジスタ
+    Reg index;         // MEMのインデックスレジスタ
+    uint8_t scale = 0; // インデックスに掛ける数 (1, 2, 4, 8)。0ならインデックスなし
+    long val;          // IMMの値、MEMのディスプレースメント
+
+    Operand() : kind(NONE), reg(Reg::RAX), index(Reg::RAX), val(0) {}
+    Operand(Reg reg) : kind(REG), reg(reg), index(Reg::RAX), val(0) {}
+    static Operand imm(long val) { return Operand(IMM, Reg::RAX, val); }
+    static Operand mem(Reg base, long disp) { return Operand(MEM, base, disp); }
+    static Operand mem(Reg base, Reg index, int scale, long disp) {
+        Operand op(MEM, base, disp);
+        op.index = index;
+        op.scale = scale;
+        return op;
+    }
+
+    bool operator==(const Operand &o) const {
+        return kind == o.kind && ((kind != REG && kind != MEM) || reg == o.reg) &&
+               ((kind != IMM && kind != MEM) || val == o.val) &&
+               (kind != MEM || (scale == o.scale && (!scale || index == o.index)));
+    }
+    bool operator!=(const Operand &o) const { return !(*this == o); }
+
+  private:
+    Operand(Kind kind, Reg reg, long val) : kind(kind), reg(reg), index(Reg::RAX), val(val) {}
+};
+
+// 条件コード。値は命令エンコーディングでの番号と同じ
+enum class Cond : uint8_t {
+    E = 0x4,
+    NE = 0x5,
+    L = 0xc,
+    GE = 0xd,
+    LE = 0xe,
+    G = 0xf,
+};
+
+// 命令の種類
+enum class Op : uint8_t {
+    LABEL, // ラベルの位置 (命令ではない)
+    MOV,   // mov a, b
+    MOVZB, // movzb a, al
+    LEA,   // lea a, b
+    ADD,   // add a, b
+    SUB,   // sub a, b
+    IMUL,  // imul a, b
+    IMUL1, // imul a (rdx:raxにrax * aを入れる)
+    AND,   // and a, b
+    SHL,   // shl a, b (bは即値)
+    SHR,   // shr a, b (bは即値)
+    SAR,   // sar a, b (bは即値)
+    CQO,   // cqo
+    IDIV,  // idiv a
+    CMP,   // cmp a, b
+    SETCC, // set<cc> al
+    PUSH,  // push a
+    POP,   // pop a
+    JMP,   // jmp label
+    JCC,   // j<cc> label
+    CALL,  // call sym
+    TAILCALL, // jmp sym (末尾呼び出し)
+    RET,   // ret
+};
+
+struct Insn {
+    Op op;
+    Cond cc = Cond::E; // SETCC, JCC
+    Operand a;
+    Operand b;
+    int label = -1;       // LABEL, JMP, JCCのラベル番号
+    std::string_view sym; // CALL, TAILCALLの呼び出し先
+};
+
+// 1つの関数の命令列
+// テキストのアセンブリにも機械語にも、ここから変換する
+struct AsmFunc {
+    std::string name;
+    std::vector<Insn> insns;
+    std::vector<std::string_view> labels; // ラベル番号ごとの名前
+    int peephole_removed = 0;             // ピープホール最適化で消した命令の数
+
+    int new_label(std::string_view name) {
+        labels.push_back(name);
+        return labels.size() - 1;
+    }
+
+    void emit(Op op, Operand a = {}, Operand b = {}) { insns.push_back(Insn{.op = op, .a = a, .b = b}); }
+    void emit_label(int label) { insns.push_back(Insn{.op = Op::LABEL, .label = label}); }
+    void jmp(int label) { insns.push_back(Insn{.op = Op::JMP, .label = label}); }
+    void jcc(Cond cc, int label) { insns.push_back(Insn{.op = Op::JCC, .cc = cc, .label = label}); }
+    void setcc(Cond cc) { insns.push_back(Insn{.op = Op::SETCC, .cc = cc}); }
+    void call(std::string_view sym) { insns.push_back(Insn{.op = Op::CALL, .sym = sym}); }
+    void tailcall(std::string_view sym) { insns.push_back(Insn{.op = Op::TAILCALL, .sym = sym}); }
+};
+
+// 出力を溜めておくためのバッファ
+// printfのような書式の解釈はせず、文字列と数値をそのまま後ろに足していく
+class Emitter {
+  public:
+    Emitter() = default;
+    Emitter(Emitter &&other) noexcept;
+    Emitter &operator=(Emitter &&other) noexcept;
+    Emitter(const Emitter &) = delete;
+    Emitter &operator=(const Emitter &) = delete;
+    ~Emitter() { free(buf); }
+
+    Emitter &operator<<(std::string_view s) {
+        char *p = reserve(s.size());
+        std::copy(s.begin(), s.end(), p);
+        len += s.size();
+        return *this;
+    }
+    Emitter &operator<<(const char *s) { return *this << std::string_view(s); }
+    Emitter &operator<<(char c) {
+        *reserve(1) = c;
+        len++;
+        return *this;
+    }
+    Emitter &operator<<(long n);
+    Emitter &operator<<(int n) { return *this << long(n); }
+    Emitter &operator<<(size_t n) { return *this << long(n); }
+    Emitter &operator<<(Reg reg) { return *this << reg_name(reg); }
+    Emitter &operator<<(const Operand &op);
+
+    // 値をリトルエンディアンのバイト列として追加する
+    template <class T> void bytes(T val) {
+        char *p = reserve(sizeof(T));
+        for (size_t i = 0; i < sizeof(T); i++)
+            p[i] = char(uint64_t(val) >> (i * 8));
+        len += sizeof(T);
+    }
+    // 後から値を書き換える (ジャンプ先などの埋め戻しに使う)
+    template <class T> void patch(size_t pos, T val) {
+        for (size_t i = 0; i < sizeof(T); i++)
+            buf[pos + i] = char(uint64_t(val) >> (i * 8));
+    }
+    // alignの倍数になるまで0を詰める
+    void align(size_t align) {
+        while (len % align)
+            *this << '\0';
+    }
+
+    std::string_view str() const { return std::string_view(buf, len); }
+    size_t size() const { return len; }
+    void clear() { len = 0; }
+
+    // ファイルディスクリプタにまとめて書き出す
+    void write_to(int fd) const;
+    // 呼び出し側のバッファに書き出し、書き出したバイト数を返す
+    size_t copy_to(char *dst, size_t size) const;
+
+  private:
+    char *reserve(size_t n) {
+        if (len + n > cap)
+            grow(len + n);
+        return buf + len;
+    }
+    void grow(size_t need);
+
+    char *buf = nullptr;
+    size_t len = 0;
+    size_t cap = 0;
+};
+
+// 命令列を簡約し、消した命令の数を返す
+int peephole(AsmFunc &fn);
+
+// 0からn-1までのそれぞれについてfを呼ぶ。jobsが2以上ならスレッドで分担する
+void parallel_for(size_t n, int jobs, const std::function<void(size_t)> &f);
+
+// 各関数を命令列に変換する
+std::vector<AsmFunc> codegen(const std::vector<Function> &prog);
+
+// 命令列をIntel記法のアセンブリとして出力する
+void emit_asm(const std::vector<AsmFunc> &funcs, Emitter &out);
+
+// 機械語に変換した結果
+struct Reloc {
+    size_t offset;        // 呼び出し先のrel32の位置
+    std::string_view sym; // 呼び出す関数
+};
 
-void codegen(const std::vector<Function> &prog);
+struct MachineCode {
+    struct Symbol {
+        std::string_view name;
+        size_t offset;
+        size_t size;
+    };
+
+    Emitter text;
+    std::vector<Symbol> funcs;
+    std::vector<Reloc> relocs; // プログラムの外の関数の呼び出し
+};
+
+// 命令列を機械語に変換する。プログラム内の関数の呼び出しは解決しておく
+MachineCode assemble(const std::vector<AsmFunc> &funcs);
+
+// プログラムから呼び出せるホスト側の関数
+struct HostFunc {
+    void *addr;
+    int nparams;
+    bool ret_int; // intを返す (raxの上位32bitは決まらない)
+};
+
+extern const std::map<std::string_view, HostFunc> host_funcs;
+
+// 機械語を実行可能なメモリに置いたもの
+// プログラムの外の関数の呼び出しはhost_funcsの関数につなぐ
+class JitCode {
+  public:
+    explicit JitCode(const std::vector<AsmFunc> &funcs);
+    JitCode(const JitCode &) = delete;
+    JitCode &operator=(const JitCode &) = delete;
+    ~JitCode();
+
+    // 引数のない関数を呼び出す
+    long call(std::string_view name) const;
+
+  private:
+    char *mem = nullptr;
+    size_t size = 0;
+    std::map<std::string, size_t, std::less<>> syms;
+};
+
+// バイトコードVMの命令。オペランドはフレーム内のレジスタ番号
+// ローカル変数はオフセット/8-1番のレジスタに置き、その後ろを一時的な値に使う
+enum class VMOp {
+    MOVI,  // a = imm(b)
+    MOV,   // a = b
+    ADD,   // a = b + c
+    ADDI,  // a = b + imm(c)
+    SUB,   // a = b - c
+    MUL,   // a = b * c
+    DIV,   // a = b / c
+    EQ,    // a = b == c
+    NE,    // a = b != c
+    LT,    // a = b < c
+    LE,    // a = b <= c
+    JMP,   // goto a
+    JZ,    // if (!b) goto a
+    JNZ,   // if (b) goto a
+    JEQ,   // if (b == c) goto a
+    JNE,   // if (b != c) goto a
+    JLT,   // if (b < c) goto a
+    JLE,   // if (b <= c) goto a
+    CALL,  // a = funcs[b](a, a+1, ..., a+c-1)。呼ばれた関数のフレームはaから始まる
+    CALLN, // a = host_funcs[b](a, a+1, ..., a+c-1)
+    RET,   // return a
+};
+
+struct VMInsn {
+    VMOp op;
+    int a, b, c;
+};
+
+struct VMFunc {
+    std::string name;
+    size_t entry; // 先頭の命令の位置
+    int nregs;    // フレームの大きさ
+};
+
+// 抽象構文木をバイトコードに変換したもの
+// アセンブルもリンクもせずにプログラムを実行できる
+class VMProgram {
+  public:
+    explicit VMProgram(const std::vector<Function> &prog);
+
+    // 引数のない関数を呼び出す
+    long call(std::string_view name) const;
+
+    size_t size() const { return code.size(); }
+
+  private:
+    std::vector<VMInsn> code;
+    std::vector<VMFunc> funcs;
+    std::vector<HostFunc> natives;
+};
+
+// 命令列を機械語に変換し、ELFの再配置可能オブジェクトファイルとして出力する
+void emit_obj(const std::vector<AsmFunc> &funcs, Emitter &out);
 
 // 引数に使うレジスタ
-const std::vector<std::string> argreg = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+const std::vector<Reg> argreg = {Reg::RDI, Reg::RSI, Reg::RDX, Reg::RCX, Reg::R8, Reg::R9};
+
+// コマンドラインオプション
+struct Options {
+    bool regalloc = false; // -fregalloc: 中間表現を経由してレジスタ割り当てを行う
+    bool fold = false;     // -ffold: 定数畳み込みと式の簡約
+    bool report = false;   // -freport: 各段階の統計を標準エラー出力に表示する
+    bool jit = false;      // -fjit: 出力せずにメモリ上で実行する
+    bool vm = false;       // -fvm: バイトコードに変換してVMで実行する
+    bool sccp = false;     // -fsccp: 疎な条件付き定数伝播
+    bool copyprop = false; // -fcopyprop: コピー伝播
+    bool dce = false;      // -fdce: 使われない命令の削除
+    bool peephole = false; // -fpeephole: 命令列のピープホール最適化
+    bool tailcall = false; // -ftail-call: 末尾呼び出しをジャンプにする
+    bool inlining = false; // -finline: 小さい関数のインライン展開
+    bool omit_frame = false; // -fomit-frame-pointer: 関数を呼ばない関数ではrbpを使わない
+    bool share_slots = false; // -fshare-slots: 生存区間が重ならない変数でスタックを共有する
+    bool const_eval = false; // -fconst-eval: 純粋な関数の呼び出しをコンパイル時に計算する
+    bool cse = false;      // -fcse: 共通部分式の削除
+    bool loop_rotate = false;    // -floop-rotate: ループの条件を本体の後ろに置く
+    bool loop_invariant = false; // -floop-invariant: ループ不変式をループの前に出す
+    bool strength_reduce = false; // -fstrength-reduce: 帰納変数の掛け算を足し算にする
+    bool unroll_loops = false;   // -funroll-loops: 回数が定数のforループを展開する
+    bool dead_code = false;      // -fdead-code: 到達しない文や使われない代入、関数を消す
+    bool dump_ir = false;  // -fdump-ir: 最適化の各段階の中間表現を表示する
+    int jobs = 1;          // -jN: コード生成に使うスレッド数
+    bool object = false;   // -c: アセンブリではなくオブジェクトファイルを出力する
+    std::string output;    // -o: 出力先のファイル (なければ標準出力)
+};
+
+extern Options opts;
+
+// レジスタ割り当て用の中間表現
+// 仮想レジスタは無限にあるものとし、ローカル変数も1つの仮想レジスタで表す
+// 最適化の間はSSA形式に変換し、レジスタ割り当ての前に元に戻す
+enum class IROp {
+    IR_IMM,  // dst = imm
+    IR_MOV,  // dst = a
+    IR_ADD,  // dst = a + b
+    IR_SUB,  // dst = a - b
+    IR_MUL,  // dst = a * b
+    IR_DIV,  // dst = a / b
+    IR_EQ,   // dst = a == b
+    IR_NE,   // dst = a != b
+    IR_LT,   // dst = a < b
+    IR_LE,   // dst = a <= b
+    IR_CALL, // dst = name(args...)
+    IR_PHI,  // dst = phi(args...) (args[i]はfrom[i]から来た場合の値)
+    IR_RET,  // return a
+    IR_JMP,  // goto then
+    IR_BR,   // if (a) goto then; else goto els
+};
+
+struct BasicBlock;
+
+struct IR {
+    IROp op;
+    int dst = -1; // 仮想レジスタ番号 (-1は無し)
+    int a = -1;
+    int b = -1;
+    long imm = 0;
+    std::string_view name; // IR_CALLの関数名
+    std::vector<int> args; // IR_CALLの引数、IR_PHIの値
+    std::vector<BasicBlock *> from; // IR_PHIの値が来るブロック
+    BasicBlock *then = nullptr;
+    BasicBlock *els = nullptr;
+};
+
+struct BasicBlock {
+    int id;
+    std::vector<IR> irs; // 最後の命令は必ずIR_RET, IR_JMP, IR_BRのどれか
+    std::vector<BasicBlock *> succ;
+    std::vector<BasicBlock *> pred;
+    std::vector<int> live_in;  // 入口で生きている仮想レジスタ (昇順)
+    std::vector<int> live_out; // 出口で生きている仮想レジスタ (昇順)
+};
+
+// 仮想レジスタの割り当て先
+struct Location {
+    int reg = -1;  // allocregの添字
+    int slot = -1; // スピルした場合のスタックスロット番号
+};
+
+// ブロックはIRFuncが持ち、IRFuncと一緒に解放する
+struct IRFunc {
+    IRFunc() = default;
+    IRFunc(IRFunc &&) = default;
+    IRFunc &operator=(IRFunc &&) = default;
+    IRFunc(const IRFunc &) = delete;
+    IRFunc &operator=(const IRFunc &) = delete;
+    ~IRFunc();
+
+    std::string name;
+    std::vector<int> params; // 引数の仮想レジスタ
+    std::vector<BasicBlock *> bbs;
+    int nvregs = 0;
+
+    // レジスタ割り当ての結果
+    std::vector<Location> locs;
+    int nslots = 0;
+    std::vector<int> used_callee_saved;
+};
+
+IRFunc gen_ir(const Function &fn);
+
+// 到達できないブロックを取り除き、succ, pred, idを付け直す
+void update_cfg(IRFunc &fn);
+
+// 各ブロックの入口と出口で生きている仮想レジスタを求める
+void liveness(IRFunc &fn);
+
+void to_ssa(IRFunc &fn);
+void from_ssa(IRFunc &fn);
+
+// 有効になっているSSA上の最適化を順に実行する
+void run_passes(IRFunc &fn);
+
+// 中間表現を標準エラー出力に表示する
+void dump_ir(const IRFunc &fn, std::string_view title);
+
+void alloc_regs(IRFunc &fn);
+
+// レジスタ割り当てに使うレジスタ
+// 先頭のnum_callee_saved個はcallee-saved、残りはcaller-saved
+const std::vector<Reg> allocreg = {Reg::RBX, Reg::R12, Reg::R13, Reg::R14,
+                                   Reg::R15, Reg::R10, Reg::R11};
+const int num_callee_saved = 5;
@@ -0,0 +1,59 @@
+#include "9cc.h"
+
+// チャンクの最小サイズ。足りなくなるたびに倍にしていく
+static const size_t min_chunk_size = 64 * 1024;
+static const size_t max_chunk_size = 4 * 1024 * 1024;
+
+void *Arena::alloc(size_t size, size_t align) {
+    char *p = reinterpret_cast<char *>((reinterpret_cast<uintptr_t>(ptr) + align - 1) & ~(align - 1));
+    if (!ptr || p + size > end) {
+        size_t chunk_size = head ? std::min(head->size * 2, max_chunk_size) : min_chunk_size;
+        chunk_size = std::max(chunk_size, size + align + sizeof(Chunk));
+        Chunk *chunk = static_cast<Chunk *>(malloc(chunk_size));
+        if (!chunk)
+            error("メモリが足りません");
+        chunk->next = head;
+        chunk->size = chunk_size;
+        head = chunk;
+        reserved_ += chunk_size;
+
+        ptr = reinterpret_cast<char *>(chunk + 1);
+        end = reinterpret_cast<char *>(chunk) + chunk_size;
+        p = reinterpret_cast<char *>((reinterpret_cast<uintptr_t>(ptr) + align - 1) & ~(align - 1));
+    }
+
+    used_ += p + size - ptr;
+    peak_ = std::max(peak_, used_);
+    ptr = p + size;
+    return p;
+}
+
+std::string_view Arena::strdup(std::string_view s) {
+    char *p = static_cast<char *>(alloc(s.size(), 1));
+    std::copy(s.begin(), s.end(), p);
+    return std::string_view(p, s.size());
+}
+
+void Arena::release() {
+    while (head) {
+        Chunk *next = head->next;
+        free(head);
+        head = next;
+    }
+    ptr = end = nullptr;
+    used_ = 0;
+    reserved_ = 0;
+}
+
+Node *alloc_node(Arena &arena, NodeKind kind) {
+    Node *node = arena.make<Node>();
+    node->kind = kind;
+    return node;
+}
+
+NodeVec *alloc_node_vec(Arena &arena, const std::vector<Node *> &nodes) {
+    NodeVec *vec = arena.make<NodeVec>(ArenaAllocator<Node *>(&arena));
+    vec->reserve(nodes.size());
+    vec->assign(nodes.begin(), nodes.end());
+    return vec;
+}
@@ -0,0 +1,54 @@
+#include "../9cc.h"
+
+#include <chrono>
+#include <fstream>
+#include <sstream>
+
+// tokenize()のスループットを測る
+// ./lex_bench [file] : fileがなければ、それらしいプログラムを並べた入力を作る
+
+static std::string make_source(size_t size) {
+    std::string src;
+    for (int i = 0; src.size() < size; i++) {
+        std::string n = std::to_string(i);
+        src += "fib" + n + "(x) {\n";
+        src += "    if (x <= 1)\n        return 1;\n";
+        src += "    return fib" + n + "(x - 1) + fib" + n + "(x - 2);\n}\n";
+        src += "sum" + n + "(n) {\n    total = 0;\n";
+        src += "    for (i = 0; i < n; i = i + 1) total = total + i * " + n + ";\n";
+        src += "    while (total >= 1000000) total = total / 2;\n";
+        src += "    return total != 0;\n}\n";
+    }
+    return src;
+}
+
+int main(int argc, char **argv) {
+    std::string src;
+    if (argc > 1) {
+        std::ifstream in(argv[1], std::ios::binary);
+        if (!in)
+            error("ファイルを開けません: %s", argv[1]);
+        std::stringstream ss;
+        ss << in.rdbuf();
+        src = ss.str();
+    } else {
+        src = make_source(16 * 1024 * 1024);
+    }
+
+    // ウォームアップ
+    size_t ntokens = tokenize(src).tokens.size();
+
+    // 計測のばらつきを抑えるため、何回か測って最も速かったものを使う
+    using clock = std::chrono::steady_clock;
+    double best = 1e9;
+    for (int round = 0; round < 5; round++) {
+        auto start = clock::now();
+        ntokens = tokenize(src).tokens.size();
+        best = std::min(best, std::chrono::duration<double>(clock::now() - start).count());
+    }
+
+    double mb = double(src.size()) / (1024 * 1024);
+    printf("input: %zu bytes, %zu tokens\n", src.size(), ntokens);
+    printf("tokenize: %.1f MB/s, %.1f Mtokens/s\n", mb / best, ntokens / best / 1e6);
+    return 0;
+}
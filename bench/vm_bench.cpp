@@ -0,0 +1,155 @@
+#include "../9cc.h"
+
+#include <chrono>
+
+// バイトコードVMと、抽象構文木をそのまま辿る素朴なインタプリタの速さを比べる
+// ./vm_bench
+
+// 比較用の木を辿るインタプリタ
+static std::map<std::string_view, const Function *> tree_funcs;
+
+struct Env {
+    std::vector<long> vars; // オフセット/8番目に変数を置く
+    bool returned = false;
+    long ret = 0;
+};
+
+static long tree_call(std::string_view name, const std::vector<long> &args);
+
+static long eval(Node *node, Env &env) {
+    switch (node->kind) {
+    case NodeKind::ND_NUM:
+        return node->val;
+    case NodeKind::ND_LVAR:
+        return env.vars[node->offset / 8];
+    case NodeKind::ND_ASSIGN:
+        return env.vars[node->lhs->offset / 8] = eval(node->rhs, env);
+    case NodeKind::ND_FUNCALL: {
+        std::vector<long> args;
+        for (auto arg : *(node->args))
+            args.push_back(eval(arg, env));
+        return tree_call(node->funcname, args);
+    }
+    case NodeKind::ND_COMMA:
+        eval(node->lhs, env);
+        return eval(node->rhs, env);
+    default:
+        break;
+    }
+
+    long l = eval(node->lhs, env);
+    long r = eval(node->rhs, env);
+    switch (node->kind) {
+    case NodeKind::ND_ADD:
+        return l + r;
+    case NodeKind::ND_SUB:
+        return l - r;
+    case NodeKind::ND_MUL:
+        return l * r;
+    case NodeKind::ND_DIV:
+        return l / r;
+    case NodeKind::ND_EQ:
+        return l == r;
+    case NodeKind::ND_NE:
+        return l != r;
+    case NodeKind::ND_LT:
+        return l < r;
+    case NodeKind::ND_LE:
+        return l <= r;
+    default:
+        error("式ではありません");
+        return 0;
+    }
+}
+
+static void exec(Node *node, Env &env) {
+    if (!node || env.returned)
+        return;
+    switch (node->kind) {
+    case NodeKind::ND_RETURN:
+        env.ret = eval(node->lhs, env);
+        env.returned = true;
+        return;
+    case NodeKind::ND_IF:
+        if (eval(node->cond, env))
+            exec(node->then, env);
+        else
+            exec(node->els, env);
+        return;
+    case NodeKind::ND_WHILE:
+    case NodeKind::ND_FOR:
+        if (node->init)
+            eval(node->init, env);
+        while (!env.returned && (!node->cond || eval(node->cond, env))) {
+            exec(node->then, env);
+            if (!env.returned && node->inc)
+                eval(node->inc, env);
+        }
+        return;
+    case NodeKind::ND_BLOCK:
+        for (auto stmt : *(node->body))
+            exec(stmt, env);
+        return;
+    default:
+        eval(node, env);
+        return;
+    }
+}
+
+static long tree_call(std::string_view name, const std::vector<long> &args) {
+    auto it = tree_funcs.find(name);
+    if (it == tree_funcs.end())
+        error("関数がありません: %.*s", int(name.size()), name.data());
+    const Function &fn = *it->second;
+    Env env;
+    env.vars.resize(fn.stack_size / 8 + 1);
+    for (size_t i = 0; i < fn.params.size() && i < args.size(); i++)
+        env.vars[fn.params[i]->offset / 8] = args[i];
+    for (auto stmt : fn.code)
+        exec(stmt, env);
+    return env.ret;
+}
+
+static const struct {
+    const char *name;
+    const char *src;
+} programs[] = {
+    {"fib", "main() { return fib(27); } fib(x) { if (x <= 1) return 1; return fib(x - 1) + fib(x - 2); }"},
+    {"loop", "main() { s = 0; for (i = 0; i < 2000; i = i + 1) { j = 0; while (j < 1000) { s = s + i * j / 7 - j; "
+             "j = j + 1; } } return s; }"},
+    {"primes", "main() { n = 0; for (i = 2; i < 40000; i = i + 1) { p = 1; for (d = 2; d * d <= i; d = d + 1) "
+               "if (i - i / d * d == 0) p = 0; n = n + p; } return n; }"},
+};
+
+// 計測のばらつきを抑えるため、何回か測って最も速かったものを使う
+template <typename F> static double best_of(F f, long &result) {
+    using clock = std::chrono::steady_clock;
+    double best = 1e9;
+    for (int round = 0; round < 3; round++) {
+        auto start = clock::now();
+        result = f();
+        best = std::min(best, std::chrono::duration<double, std::milli>(clock::now() - start).count());
+    }
+    return best;
+}
+
+int main() {
+    for (auto &p : programs) {
+        Arena arena;
+        TokenStream tokens = tokenize(p.src);
+        auto prog = program(tokens, arena);
+
+        tree_funcs.clear();
+        for (auto &fn : prog)
+            tree_funcs[fn.name] = &fn;
+        VMProgram vm(prog);
+
+        long tree_result, vm_result;
+        double tree = best_of([] { return tree_call("main", {}); }, tree_result);
+        double bytecode = best_of([&] { return vm.call("main"); }, vm_result);
+        if (tree_result != vm_result)
+            error("%s: 結果が一致しません: %ld, %ld", p.name, tree_result, vm_result);
+        printf("%-7s tree %8.1f ms, vm %8.1f ms (%.1fx)\n", p.name, tree, bytecode, tree / bytecode);
+    }
+    return 0;
+}
@@ -1,214 +1,840 @@
 #include "9cc.h"
 
-static int cnt = 0;
-static std::string make_label(const std::string &s) { return ".L." + s + std::to_string(cnt++); }
-static std::string funcname;
+#include <atomic>
+#include <thread>
 
-static void gen_lval(Node *node) {
+// 関数ごとに別のスレッドでコードを生成できるよう、状態はスレッドごとに持つ
+static thread_local AsmFunc *out;
+static thread_local int return_label;
+static thread_local int body_label; // プロローグの後。自分自身の末尾呼び出しはここに戻る
+
+// 関数を呼ばない関数ではrbpを保存せず、変数や引数をrspからの位置で指す
+// ret_addr_offsetはそのときのrspから戻り番地までの距離
+static thread_local bool frameless;
+static thread_local int ret_addr_offset;
+
+// スタックに積んでいる値の数
+// 関数の呼び出しでrspを16の倍数に揃えるために、実行時に調べずコンパイル時に数えておく
+// rbpを使わない場合は、変数の位置をrspから求めるのにも使う
+static thread_local int depth;
+
+static int make_label(std::string_view s) { return out->new_label(s); }
+
+static void load_rax(const Operand &src) {
+    if (src != Reg::RAX)
+        out->emit(Op::MOV, Reg::RAX, src);
+}
+
+// 定数cによる掛け算を、leaとshlに置き換える
+// c = m * 2^k (mは1, 3, 5, 9) なら、srcの値をraxに入れて計算し、結果をraxに残してtrueを返す
+// 置き換えられなければ何も出力せずfalseを返す
+static bool gen_mul_imm(const Operand &src, long c) {
+    if (c == 0) {
+        out->emit(Op::MOV, Reg::RAX, Operand::imm(0));
+        return true;
+    }
+    if (c < 0)
+        return false;
+
+    int k = __builtin_ctzl(c);
+    long m = c >> k;
+    if (m != 1 && m != 3 && m != 5 && m != 9)
+        return false;
+    load_rax(src);
+    if (m > 1)
+        out->emit(Op::LEA, Reg::RAX, Operand::mem(Reg::RAX, Reg::RAX, m - 1, 0));
+    if (k)
+        out->emit(Op::SHL, Reg::RAX, Operand::imm(k));
+    return true;
+}
+
+// 符号付き64bitの割り算に使う魔法数とシフト量 (Hacker's Delight 10-1)
+// |d| >= 2であること
+static void div_magic(long d, long &magic, int &shift) {
+    const uint64_t two63 = 1ull << 63;
+    uint64_t ad = d < 0 ? -(uint64_t)d : d;
+    uint64_t t = two63 + ((uint64_t)d >> 63);
+    uint64_t anc = t - 1 - t % ad;
+    int p = 63;
+    uint64_t q1 = two63 / anc, r1 = two63 - q1 * anc;
+    uint64_t q2 = two63 / ad, r2 = two63 - q2 * ad;
+    uint64_t delta;
+    do {
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) {
+            q1++;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= ad) {
+            q2++;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+
+    magic = q2 + 1;
+    if (d < 0)
+        magic = -magic;
+    shift = p - 64;
+}
+
+// 定数dによる割り算を、シフトや魔法数の掛け算に置き換える。0への丸めはidivと同じ
+// 置き換えられるなら、srcの値をraxに入れて計算し、結果をraxに残してtrueを返す
+// 置き換えられなければ何も出力せずfalseを返す。rdxとrdiを壊す
+static bool gen_div_imm(const Operand &src, long d) {
+    // 0と-1はidivに任せる (ゼロ除算とオーバーフローの例外も含めて同じ動きにする)
+    if (d == 0 || d == -1)
+        return false;
+    load_rax(src);
+    if (d == 1)
+        return true;
+
+    // 2^kなら、負の数は2^k-1を足してから算術シフトする
+    if (d > 0 && (d & (d - 1)) == 0) {
+        int k = __builtin_ctzl(d);
+        out->emit(Op::MOV, Reg::RDX, Reg::RAX);
+        if (k > 1)
+            out->emit(Op::SAR, Reg::RDX, Operand::imm(63));
+        out->emit(Op::SHR, Reg::RDX, Operand::imm(64 - k));
+        out->emit(Op::ADD, Reg::RAX, Reg::RDX);
+        out->emit(Op::SAR, Reg::RAX, Operand::imm(k));
+        return true;
+    }
+
+    // 魔法数を掛けた上位64bitをシフトし、商が負なら1を足す
+    long magic;
+    int shift;
+    div_magic(d, magic, shift);
+    out->emit(Op::MOV, Reg::RDI, Reg::RAX);
+    out->emit(Op::MOV, Reg::RAX, Operand::imm(magic));
+    out->emit(Op::IMUL1, Reg::RDI);
+    if (d > 0 && magic < 0)
+        out->emit(Op::ADD, Reg::RDX, Reg::RDI);
+    if (d < 0 && magic > 0)
+        out->emit(Op::SUB, Reg::RDX, Reg::RDI);
+    if (shift)
+        out->emit(Op::SAR, Reg::RDX, Operand::imm(shift));
+    out->emit(Op::MOV, Reg::RAX, Reg::RDX);
+    out->emit(Op::SHR, Reg::RAX, Operand::imm(63));
+    out->emit(Op::ADD, Reg::RAX, Reg::RDX);
+    return true;
+}
+
+// 変数の場所を[rbp-offset]のメモリオペランドとして返す
+static Operand gen_lval(Node *node) {
     if (node->kind != NodeKind::ND_LVAR)
         error("代入の左辺値が変数ではありません");
 
-    printf("  mov rax, rbp\n");
-    printf("  sub rax, %d\n", node->offset);
-    printf("  push rax\n");
+    // 変数の領域はちょうど戻り番地の下にある
+    if (frameless)
+        return Operand::mem(Reg::RSP, depth * 8 + ret_addr_offset - node->offset);
+    return Operand::mem(Reg::RBP, -node->offset);
 }
 
-static void gen(Node *node) {
+// 数値は即値、変数はメモリオペランドとして命令に直接書ける
+static std::optional<Operand> direct_operand(Node *node) {
+    if (node->kind == NodeKind::ND_NUM)
+        return Operand::imm(node->val);
+    if (node->kind == NodeKind::ND_LVAR)
+        return gen_lval(node);
+    return std::nullopt;
+}
+
+static void push(const Operand &op) {
+    out->emit(Op::PUSH, op);
+    depth++;
+}
+
+static void pop(Reg reg) {
+    out->emit(Op::POP, reg);
+    depth--;
+}
+
+// n個分の領域をスタックに確保する (負なら解放する)
+static void sub_rsp(int n) {
+    if (n > 0)
+        out->emit(Op::SUB, Reg::RSP, Operand::imm(n * 8));
+    else
+        out->emit(Op::ADD, Reg::RSP, Operand::imm(-n * 8));
+    depth += n;
+}
+
+static void gen(Node *node);
+
+// i番目 (7個目以降) の引数の、呼び出された側から見た場所
+static Operand stack_param(int i) {
+    int pos = (i - int(argreg.size())) * 8;
+    if (frameless)
+        return Operand::mem(Reg::RSP, ret_addr_offset + 8 + pos);
+    return Operand::mem(Reg::RBP, 16 + pos);
+}
+
+static bool has_call(Node *node) {
     if (!node)
+        return false;
+    if (node->kind == NodeKind::ND_FUNCALL)
+        return true;
+    if (node->body)
+        for (auto stmt : *(node->body))
+            if (has_call(stmt))
+                return true;
+    return has_call(node->lhs) || has_call(node->rhs) || has_call(node->cond) || has_call(node->then) ||
+           has_call(node->els) || has_call(node->init) || has_call(node->inc);
+}
+
+// 式の値をraxに入れる
+static void gen_rax(Node *node) {
+    if (auto op = direct_operand(node)) {
+        out->emit(Op::MOV, Reg::RAX, *op);
         return;
+    }
+    gen(node);
+    pop(Reg::RAX);
+}
+
+// 左辺の値をraxに入れ、右辺をraxと演算できるオペランドにして返す
+// 右辺が直接書けなければ、スタックを経由してrdiに入れる
+static Operand gen_operands(Node *lhs, Node *rhs) {
+    if (auto op = direct_operand(rhs)) {
+        gen_rax(lhs);
+        return *op;
+    }
+    gen(lhs);
+    gen(rhs);
+    pop(Reg::RDI);
+    pop(Reg::RAX);
+    return Reg::RDI;
+}
+
+// 比較の結果を0か1にしてraxに入れる
+static void gen_setcc(Cond cc, const Operand &rhs) {
+    out->emit(Op::CMP, Reg::RAX, rhs);
+    out->setcc(cc);
+    out->emit(Op::MOVZB, Reg::RAX);
+}
+
+// 比較のノードなら、その比較が真になる条件コードを返す
+static std::optional<Cond> compare_cond(NodeKind kind) {
+    switch (kind) {
+    case NodeKind::ND_EQ:
+        return Cond::E;
+    case NodeKind::ND_NE:
+        return Cond::NE;
+    case NodeKind::ND_LT:
+        return Cond::L;
+    case NodeKind::ND_LE:
+        return Cond::LE;
+    default:
+        return std::nullopt;
+    }
+}
+
+static Cond negate(Cond cc) {
+    switch (cc) {
+    case Cond::E:
+        return Cond::NE;
+    case Cond::NE:
+        return Cond::E;
+    case Cond::L:
+        return Cond::GE;
+    case Cond::GE:
+        return Cond::L;
+    case Cond::LE:
+        return Cond::G;
+    case Cond::G:
+        return Cond::LE;
+    }
+    return cc;
+}
+
+// condの真偽がjump_ifと一致したらlabelへジャンプする
+// 比較ならcmpの結果で直接ジャンプし、0か1の値は作らない
+static void gen_branch(Node *cond, bool jump_if, int label) {
+    if (auto cc = compare_cond(cond->kind)) {
+        Operand rhs = gen_operands(cond->lhs, cond->rhs);
+        out->emit(Op::CMP, Reg::RAX, rhs);
+        out->jcc(jump_if ? *cc : negate(*cc), label);
+        return;
+    }
+
+    gen_rax(cond);
+    out->emit(Op::CMP, Reg::RAX, Operand::imm(0));
+    out->jcc(jump_if ? Cond::NE : Cond::E, label);
+}
+
+// 式を評価して結果をスタックに積む
+static void gen(Node *node) {
     switch (node->kind) {
     case NodeKind::ND_NUM:
-        printf("  push %d\n", node->val);
+        push(Operand::imm(node->val));
         return;
     case NodeKind::ND_LVAR:
-        gen_lval(node);
-        printf("  pop rax\n");
-        printf("  mov rax, [rax]\n");
-        printf("  push rax\n");
-        return;
-    case NodeKind::ND_ASSIGN:
-        gen_lval(node->lhs);
-        gen(node->rhs);
-
-        printf("  pop rdi\n");
-        printf("  pop rax\n");
-        printf("  mov [rax], rdi\n");
-        printf("  push rdi\n");
-        return;
-    case NodeKind::ND_RETURN:
-        gen(node->lhs);
-        printf("  pop rax\n");
-        printf("  jmp .L.return.%s\n", funcname.c_str());
-        return;
-    case NodeKind::ND_IF:
-        if (!node->els) {
-            std::string end = make_label("end");
-
-            gen(node->cond);
-            printf("  pop rax\n");
-            printf("  cmp rax, 0\n");
-            printf("  je %s\n", end.c_str());
-            gen(node->then);
-            printf("%s:\n", end.c_str());
-        } else {
-            std::string els = make_label("else");
-            std::string end = make_label("end");
-
-            gen(node->cond);
-            printf("  pop rax\n");
-            printf("  cmp rax, 0\n");
-            printf("  je %s\n", els.c_str());
-            gen(node->then);
-            printf("  jmp %s\n", end.c_str());
-            printf("%s:\n", els.c_str());
-            gen(node->els);
-            printf("%s:\n", end.c_str());
-        }
+        out->emit(Op::MOV, Reg::RAX, gen_lval(node));
+        push(Reg::RAX);
         return;
-    case NodeKind::ND_WHILE: {
-        std::string begin = make_label("begin");
-        std::string end = make_label("end");
-
-        printf("%s:\n", begin.c_str());
-        gen(node->cond);
-        printf("  pop rax\n");
-        printf("  cmp rax, 0\n");
-        printf("  je %s\n", end.c_str());
-        gen(node->then);
-        printf("  jmp %s\n", begin.c_str());
-        printf("%s:\n", end.c_str());
+    case NodeKind::ND_ASSIGN: {
+        Operand dst = gen_lval(node->lhs);
+        gen_rax(node->rhs);
+        out->emit(Op::MOV, dst, Reg::RAX);
+        push(Reg::RAX);
         return;
     }
-    case NodeKind::ND_FOR: {
-        std::string begin = make_label("begin");
-        std::string end = make_label("end");
-
-        gen(node->init);
-        printf("%s:\n", begin.c_str());
-        if (node->cond) {
-            gen(node->cond);
-            printf("  pop rax\n");
-            printf("  cmp rax, 0\n");
-            printf("  je %s\n", end.c_str());
-        }
-        gen(node->then);
-        gen(node->inc);
-        printf("  jmp %s\n", begin.c_str());
-        printf("%s:\n", end.c_str());
-        return;
-    }
-    case NodeKind::ND_BLOCK:
-        for (auto stmt : *(node->body)) {
-            gen(stmt);
-            printf("  pop rax\n");
-        }
-        printf("  push rax\n");
-        return;
     case NodeKind::ND_FUNCALL: {
+        // 7個目からの引数はスタックに置く。その場所を先に空けておき、
+        // 引数をすべて評価した後で、レジスタの引数と一緒にスタックから移す
+        // 呼び出しの時点でrspが16の倍数になるよう、積んでいる数から詰め物の要否を決める
+        int nargs = node->args->size();
+        int nstack = std::max(0, nargs - int(argreg.size()));
+        int pad = (depth + nstack) % 2;
+        if (pad + nstack)
+            sub_rsp(pad + nstack);
+
         for (auto arg : *(node->args))
             gen(arg);
-        for (int i = int(node->args->size()) - 1; i >= 0; i--)
-            printf("  pop %s\n", argreg[i].c_str());
+        for (int i = nargs - 1; i >= 0; i--) {
+            if (i < int(argreg.size())) {
+                pop(argreg[i]);
+                continue;
+            }
+            // 残りのi個の値の下が引数の領域になっている
+            pop(Reg::RAX);
+            out->emit(Op::MOV, Operand::mem(Reg::RSP, (i + i - int(argreg.size())) * 8), Reg::RAX);
+        }
 
-        // 関数を呼び出す前にrspが16の倍数になるように調整する
-        // chibicc
-        // We need to align RSP to a 16 byte boundary before
-        // calling a function because it is an ABI requirement.
         // RAX is set to 0 for variadic function.
-        std::string call = make_label("call");
-        std::string end = make_label("end");
-        printf("  mov rax, rsp\n");
-        printf("  and rax, 15\n");
-        printf("  jnz %s\n", call.c_str());
-        printf("  mov rax, 0\n");
-        printf("  call %s\n", node->funcname.c_str());
-        printf("  jmp %s\n", end.c_str());
-        printf("%s:\n", call.c_str());
-        printf("  sub rsp, 8\n");
-        printf("  mov rax, 0\n");
-        printf("  call %s\n", node->funcname.c_str());
-        printf("  add rsp, 8\n");
-        printf("%s:\n", end.c_str());
-        printf("  push rax\n");
+        out->emit(Op::MOV, Reg::RAX, Operand::imm(0));
+        out->call(node->funcname);
+        if (pad + nstack)
+            sub_rsp(-(pad + nstack));
+        push(Reg::RAX);
         return;
     }
+    case NodeKind::ND_COMMA:
+        gen_rax(node->lhs);
+        gen(node->rhs);
+        return;
     default:
         break;
     }
 
-    gen(node->lhs);
-    gen(node->rhs);
+    // 足し算と掛け算は、左辺が数値なら入れ替えて即値にする
+    // 変数は入れ替えると読む順番が変わるので入れ替えない
+    Node *lhs = node->lhs;
+    Node *rhs = node->rhs;
+    if ((node->kind == NodeKind::ND_ADD || node->kind == NodeKind::ND_MUL) &&
+        lhs->kind == NodeKind::ND_NUM && rhs->kind != NodeKind::ND_NUM)
+        std::swap(lhs, rhs);
 
-    printf("  pop rdi\n");
-    printf("  pop rax\n");
+    Operand src = gen_operands(lhs, rhs);
 
     switch (node->kind) {
     case NodeKind::ND_ADD:
-        printf("  add rax, rdi\n");
+        // 定数を足すならleaを使う
+        if (src.kind == Operand::IMM)
+            out->emit(Op::LEA, Reg::RAX, Operand::mem(Reg::RAX, src.val));
+        else
+            out->emit(Op::ADD, Reg::RAX, src);
         break;
     case NodeKind::ND_SUB:
-        printf("  sub rax, rdi\n");
+        out->emit(Op::SUB, Reg::RAX, src);
         break;
     case NodeKind::ND_MUL:
-        printf("  imul rax, rdi\n");
+        if (src.kind == Operand::IMM && gen_mul_imm(Reg::RAX, src.val))
+            break;
+        out->emit(Op::IMUL, Reg::RAX, src);
         break;
     case NodeKind::ND_DIV:
-        printf("  cqo\n");
-        printf("  idiv rdi\n");
-        break;
-    case NodeKind::ND_EQ:
-        printf("  cmp rax, rdi\n");
-        printf("  sete al\n");
-        printf("  movzb rax, al\n");
-        break;
-    case NodeKind::ND_NE:
-        printf("  cmp rax, rdi\n");
-        printf("  setne al\n");
-        printf("  movzb rax, al\n");
-        break;
-    case NodeKind::ND_LT:
-        printf("  cmp rax, rdi\n");
-        printf("  setl al\n");
-        printf("  movzb rax, al\n");
-        break;
-    case NodeKind::ND_LE:
-        printf("  cmp rax, rdi\n");
-        printf("  setle al\n");
-        printf("  movzb rax, al\n");
+        if (src.kind == Operand::IMM && gen_div_imm(Reg::RAX, src.val))
+            break;
+        // idivは即値を取れない
+        if (src.kind == Operand::IMM) {
+            out->emit(Op::MOV, Reg::RDI, src);
+            src = Reg::RDI;
+        }
+        out->emit(Op::CQO);
+        out->emit(Op::IDIV, src);
         break;
     default:
-        exit(1);
+        if (auto cc = compare_cond(node->kind))
+            gen_setcc(*cc, src);
+        else
+            exit(1);
     }
 
-    printf("  push rax\n");
+    push(Reg::RAX);
 }
 
-void codegen(const std::vector<Function> &prog) {
-    // アセンブリの前半部分を出力
-    printf(".intel_syntax noprefix\n");
+static thread_local const Function *cur_fn;
 
-    for (auto fn : prog) {
-        printf(".global %s\n", fn.name.c_str());
-        printf("%s:\n", fn.name.c_str());
-        funcname = fn.name;
+// return f(...) のfの呼び出しを、今のフレームを片付けてからのジャンプにする
+// 自分自身の呼び出しなら、引数を書き換えて関数の先頭に戻るループにする
+// スタックで渡す引数があるものはそのまま呼び出す
+static bool gen_tailcall(Node *node) {
+    if (!opts.tailcall || node->kind != NodeKind::ND_FUNCALL || node->args->size() > argreg.size())
+        return false;
 
-        // プロローグ
-        printf("  push rbp\n");
-        printf("  mov rbp, rsp\n");
-        printf("  sub rsp, %d\n", fn.stack_size);
+    int nargs = node->args->size();
+    for (auto arg : *(node->args))
+        gen(arg);
+    for (int i = nargs - 1; i >= 0; i--)
+        pop(argreg[i]);
 
-        for (size_t i = 0; i < fn.params.size(); i++) {
-            printf("  mov [rbp-%d], %s\n", fn.params[i]->offset, argreg[i].c_str());
+    if (node->funcname == cur_fn->name && nargs == int(cur_fn->params.size())) {
+        for (int i = 0; i < nargs; i++)
+            out->emit(Op::MOV, gen_lval(cur_fn->params[i]), argreg[i]);
+        out->jmp(body_label);
+        return true;
+    }
+
+    out->emit(Op::MOV, Reg::RSP, Reg::RBP);
+    out->emit(Op::POP, Reg::RBP);
+    out->emit(Op::MOV, Reg::RAX, Operand::imm(0));
+    out->tailcall(node->funcname);
+    return true;
+}
+
+// 文を実行する。スタックの深さは文の前後で変わらない
+static void gen_stmt(Node *node) {
+    if (!node)
+        return;
+    switch (node->kind) {
+    case NodeKind::ND_RETURN:
+        if (gen_tailcall(node->lhs))
+            return;
+        gen_rax(node->lhs);
+        out->jmp(return_label);
+        return;
+    case NodeKind::ND_IF:
+        if (!node->els) {
+            int end = make_label("end");
+
+            gen_branch(node->cond, false, end);
+            gen_stmt(node->then);
+            out->emit_label(end);
+        } else {
+            int els = make_label("else");
+            int end = make_label("end");
+
+            gen_branch(node->cond, false, els);
+            gen_stmt(node->then);
+            out->jmp(end);
+            out->emit_label(els);
+            gen_stmt(node->els);
+            out->emit_label(end);
+        }
+        return;
+    case NodeKind::ND_WHILE:
+    case NodeKind::ND_FOR: {
+        gen_stmt(node->init);
+        if (opts.loop_rotate && node->cond) {
+            // 条件を本体の後ろに置き、1周ごとのジャンプを条件分岐1つにする
+            int body = make_label("body");
+            int cond = make_label("cond");
+
+            out->jmp(cond);
+            out->emit_label(body);
+            gen_stmt(node->then);
+            gen_stmt(node->inc);
+            out->emit_label(cond);
+            gen_branch(node->cond, true, body);
+            return;
+        }
+
+        int begin = make_label("begin");
+        int end = make_label("end");
+
+        out->emit_label(begin);
+        if (node->cond)
+            gen_branch(node->cond, false, end);
+        gen_stmt(node->then);
+        gen_stmt(node->inc);
+        out->jmp(begin);
+        out->emit_label(end);
+        return;
+    }
+    case NodeKind::ND_BLOCK:
+        for (auto stmt : *(node->body))
+            gen_stmt(stmt);
+        return;
+    default:
+        // 式文の値は捨てる
+        gen_rax(node);
+        return;
+    }
+}
+
+// ここからはレジスタ割り当て済みの中間表現からコードを生成する
+
+static thread_local IRFunc *irfn;
+static thread_local std::vector<int> bb_labels;
+static thread_local std::vector<std::optional<long>> consts;
+
+// 関数の中でIR_IMMだけから値が決まる仮想レジスタの値を求める
+static void find_consts(const IRFunc &fn) {
+    std::vector<int> ndefs(fn.nvregs);
+    for (int v : fn.params)
+        ndefs[v]++;
+    consts.assign(fn.nvregs, std::nullopt);
+    for (auto bb : fn.bbs) {
+        for (auto &ir : bb->irs) {
+            if (ir.dst < 0)
+                continue;
+            ndefs[ir.dst]++;
+            if (ir.op == IROp::IR_IMM)
+                consts[ir.dst] = ir.imm;
+        }
+    }
+    for (int v = 0; v < fn.nvregs; v++)
+        if (ndefs[v] != 1)
+            consts[v] = std::nullopt;
+}
+
+static bool in_reg(int v) { return irfn->locs[v].reg >= 0; }
+
+// 使われない引数には場所が割り当てられていない
+static bool has_loc(int v) { return irfn->locs[v].reg >= 0 || irfn->locs[v].slot >= 0; }
+
+static Operand loc(int v) {
+    Location &l = irfn->locs[v];
+    if (l.reg >= 0)
+        return allocreg[l.reg];
+    // スピルスロットは退避したcallee-savedレジスタの下に置く
+    // rbpを使わない場合はrspの下のレッドゾーンに置く
+    if (frameless)
+        return Operand::mem(Reg::RSP, -(l.slot + 1) * 8);
+    int offset = (irfn->used_callee_saved.size() + l.slot + 1) * 8;
+    return Operand::mem(Reg::RBP, -offset);
+}
+
+static void gen_mov(const Operand &dst, const Operand &src) {
+    if (dst == src)
+        return;
+    // メモリ同士のmovはできないのでraxを経由する
+    if (dst.kind == Operand::MEM && src.kind == Operand::MEM) {
+        out->emit(Op::MOV, Reg::RAX, src);
+        out->emit(Op::MOV, dst, Reg::RAX);
+        return;
+    }
+    out->emit(Op::MOV, dst, src);
+}
+
+static void gen_arith(Op op, const IR &ir, bool commutative) {
+    Operand dst = loc(ir.dst);
+    if (in_reg(ir.dst) && dst != loc(ir.b)) {
+        gen_mov(dst, loc(ir.a));
+        out->emit(op, dst, loc(ir.b));
+        return;
+    }
+    if (in_reg(ir.dst) && commutative) {
+        out->emit(op, dst, loc(ir.a));
+        return;
+    }
+    out->emit(Op::MOV, Reg::RAX, loc(ir.a));
+    out->emit(op, Reg::RAX, loc(ir.b));
+    gen_mov(dst, Reg::RAX);
+}
+
+static void gen_cmp(Cond cc, const IR &ir) {
+    Operand a = loc(ir.a);
+    if (!in_reg(ir.a)) {
+        out->emit(Op::MOV, Reg::RAX, a);
+        a = Reg::RAX;
+    }
+    out->emit(Op::CMP, a, loc(ir.b));
+    out->setcc(cc);
+    if (in_reg(ir.dst)) {
+        out->emit(Op::MOVZB, loc(ir.dst));
+    } else {
+        out->emit(Op::MOVZB, Reg::RAX);
+        gen_mov(loc(ir.dst), Reg::RAX);
+    }
+}
+
+static void gen_ir_inst(const IR &ir, BasicBlock *next) {
+    switch (ir.op) {
+    case IROp::IR_IMM:
+        // 32bitに収まらない即値はレジスタにしか直接入れられない
+        if (!in_reg(ir.dst) && (ir.imm < INT32_MIN || INT32_MAX < ir.imm)) {
+            out->emit(Op::MOV, Reg::RAX, Operand::imm(ir.imm));
+            gen_mov(loc(ir.dst), Reg::RAX);
+            return;
+        }
+        out->emit(Op::MOV, loc(ir.dst), Operand::imm(ir.imm));
+        return;
+    case IROp::IR_MOV:
+        gen_mov(loc(ir.dst), loc(ir.a));
+        return;
+    case IROp::IR_ADD:
+        gen_arith(Op::ADD, ir, true);
+        return;
+    case IROp::IR_SUB:
+        gen_arith(Op::SUB, ir, false);
+        return;
+    case IROp::IR_MUL:
+        if (consts[ir.b] && gen_mul_imm(loc(ir.a), *consts[ir.b])) {
+            gen_mov(loc(ir.dst), Reg::RAX);
+            return;
+        }
+        if (consts[ir.a] && gen_mul_imm(loc(ir.b), *consts[ir.a])) {
+            gen_mov(loc(ir.dst), Reg::RAX);
+            return;
+        }
+        gen_arith(Op::IMUL, ir, true);
+        return;
+    case IROp::IR_DIV:
+        if (consts[ir.b] && gen_div_imm(loc(ir.a), *consts[ir.b])) {
+            gen_mov(loc(ir.dst), Reg::RAX);
+            return;
+        }
+        out->emit(Op::MOV, Reg::RAX, loc(ir.a));
+        out->emit(Op::CQO);
+        out->emit(Op::IDIV, loc(ir.b));
+        gen_mov(loc(ir.dst), Reg::RAX);
+        return;
+    case IROp::IR_EQ:
+        gen_cmp(Cond::E, ir);
+        return;
+    case IROp::IR_NE:
+        gen_cmp(Cond::NE, ir);
+        return;
+    case IROp::IR_LT:
+        gen_cmp(Cond::L, ir);
+        return;
+    case IROp::IR_LE:
+        gen_cmp(Cond::LE, ir);
+        return;
+    case IROp::IR_CALL: {
+        // フレームの大きさは16の倍数に揃えてあるので、
+        // スタックに積む引数が奇数個のときだけ詰め物をする
+        int nstack = std::max(0, int(ir.args.size()) - int(argreg.size()));
+        int pad = nstack % 2;
+        if (pad)
+            out->emit(Op::SUB, Reg::RSP, Operand::imm(8));
+        for (int i = int(ir.args.size()) - 1; i >= int(argreg.size()); i--) {
+            Operand arg = loc(ir.args[i]);
+            if (!in_reg(ir.args[i])) {
+                out->emit(Op::MOV, Reg::RAX, arg);
+                arg = Reg::RAX;
+            }
+            out->emit(Op::PUSH, arg);
         }
 
-        for (auto node : fn.code) {
-            gen(node);
+        // 割り当てに引数レジスタは使わないので、そのまま順に移せる
+        for (size_t i = 0; i < ir.args.size() && i < argreg.size(); i++)
+            gen_mov(argreg[i], loc(ir.args[i]));
+        out->emit(Op::MOV, Reg::RAX, Operand::imm(0));
+        out->call(ir.name);
+        if (nstack)
+            out->emit(Op::ADD, Reg::RSP, Operand::imm((nstack + pad) * 8));
+        gen_mov(loc(ir.dst), Reg::RAX);
+        return;
+    }
+    case IROp::IR_RET:
+        gen_mov(Reg::RAX, loc(ir.a));
+        out->jmp(return_label);
+        return;
+    case IROp::IR_JMP:
+        if (ir.then != next)
+            out->jmp(bb_labels[ir.then->id]);
+        return;
+    case IROp::IR_PHI:
+        error("phiが残っています");
+        return;
+    case IROp::IR_BR:
+        out->emit(Op::CMP, loc(ir.a), Operand::imm(0));
+        if (ir.els == next) {
+            out->jcc(Cond::NE, bb_labels[ir.then->id]);
+        } else {
+            out->jcc(Cond::E, bb_labels[ir.els->id]);
+            if (ir.then != next)
+                out->jmp(bb_labels[ir.then->id]);
         }
+        return;
+    }
+}
+
+// 退避したレジスタを戻してフレームを片付ける
+static void gen_ir_epilogue() {
+    int saved_size = irfn->used_callee_saved.size() * 8;
+    if (frameless) {
+        for (auto it = irfn->used_callee_saved.rbegin(); it != irfn->used_callee_saved.rend(); it++)
+            out->emit(Op::POP, allocreg[*it]);
+        return;
+    }
+    if (saved_size)
+        out->emit(Op::LEA, Reg::RSP, Operand::mem(Reg::RBP, -saved_size));
+    else
+        out->emit(Op::MOV, Reg::RSP, Reg::RBP);
+    for (auto it = irfn->used_callee_saved.rbegin(); it != irfn->used_callee_saved.rend(); it++)
+        out->emit(Op::POP, allocreg[*it]);
+    out->emit(Op::POP, Reg::RBP);
+}
+
+// 引数は割り当てに使わないレジスタに先に移すので、引数の間で値を壊し合うことはない
+// 呼び出しの後に生きている値はないので、仮引数の場所も自由に書き換えてよい
+static void gen_ir_tailcall(const IR &ir) {
+    for (size_t i = 0; i < ir.args.size(); i++)
+        gen_mov(argreg[i], loc(ir.args[i]));
+
+    if (ir.name == irfn->name && ir.args.size() == irfn->params.size()) {
+        for (size_t i = 0; i < ir.args.size(); i++)
+            if (has_loc(irfn->params[i]))
+                gen_mov(loc(irfn->params[i]), argreg[i]);
+        out->jmp(bb_labels[irfn->bbs[0]->id]);
+        return;
+    }
+
+    gen_ir_epilogue();
+    out->emit(Op::MOV, Reg::RAX, Operand::imm(0));
+    out->tailcall(ir.name);
+}
+
+static void gen_ir_func(IRFunc &fn) {
+    irfn = &fn;
+    find_consts(fn);
+    bb_labels.clear();
+    for (size_t i = 0; i < fn.bbs.size(); i++)
+        bb_labels.push_back(make_label("bb"));
+
+    // 関数を呼ばず、スピルスロットがレッドゾーン (rspの下128バイト) に収まるならrspを動かさない
+    bool leaf = std::none_of(fn.bbs.begin(), fn.bbs.end(), [](BasicBlock *bb) {
+        return std::any_of(bb->irs.begin(), bb->irs.end(), [](const IR &ir) { return ir.op == IROp::IR_CALL; });
+    });
+    frameless = opts.omit_frame && leaf && fn.nslots * 8 <= 128;
 
-        // エピローグ
-        printf(".L.return.%s:\n", funcname.c_str());
-        printf("  mov rsp, rbp\n");
-        printf("  pop rbp\n");
-        printf("  ret\n");
+    // プロローグ
+    // 退避するレジスタとスピルスロットを合わせて16の倍数になるようにする
+    int saved_size = fn.used_callee_saved.size() * 8;
+    int frame_size = fn.nslots * 8;
+    if ((saved_size + frame_size) % 16)
+        frame_size += 8;
+    if (!frameless) {
+        out->emit(Op::PUSH, Reg::RBP);
+        out->emit(Op::MOV, Reg::RBP, Reg::RSP);
     }
+    for (int r : fn.used_callee_saved)
+        out->emit(Op::PUSH, allocreg[r]);
+    if (!frameless && frame_size)
+        out->emit(Op::SUB, Reg::RSP, Operand::imm(frame_size));
+    ret_addr_offset = saved_size;
+
+    for (size_t i = 0; i < fn.params.size(); i++)
+        if (has_loc(fn.params[i]))
+            gen_mov(loc(fn.params[i]), i < argreg.size() ? Operand(argreg[i]) : stack_param(i));
+
+    for (size_t i = 0; i < fn.bbs.size(); i++) {
+        BasicBlock *bb = fn.bbs[i];
+        BasicBlock *next = i + 1 < fn.bbs.size() ? fn.bbs[i + 1] : nullptr;
+        out->emit_label(bb_labels[bb->id]);
+        for (size_t j = 0; j < bb->irs.size(); j++) {
+            // 呼び出しの結果をそのまま返すなら、末尾呼び出しにして残りは出力しない
+            IR &ir = bb->irs[j];
+            if (opts.tailcall && ir.op == IROp::IR_CALL && ir.args.size() <= argreg.size() &&
+                j + 1 < bb->irs.size() && bb->irs[j + 1].op == IROp::IR_RET && bb->irs[j + 1].a == ir.dst) {
+                gen_ir_tailcall(ir);
+                break;
+            }
+            gen_ir_inst(ir, next);
+        }
+    }
+
+    // エピローグ
+    out->emit_label(return_label);
+    gen_ir_epilogue();
+    out->emit(Op::RET);
+}
+
+static void gen_func(const Function &fn) {
+    // プロローグ
+    // 関数を呼ばないならrspを揃える必要はないので、変数の領域だけ確保する
+    // 値をpushするとレッドゾーンは壊れるので、変数はrspより上に置く
+    frameless = opts.omit_frame && std::none_of(fn.code.begin(), fn.code.end(), has_call);
+    int frame_size = fn.stack_size;
+    if (frameless) {
+        ret_addr_offset = frame_size;
+    } else {
+        // ローカル変数の領域は16の倍数にして、rspが揃った状態から数え始める
+        frame_size = (frame_size + 15) / 16 * 16;
+        out->emit(Op::PUSH, Reg::RBP);
+        out->emit(Op::MOV, Reg::RBP, Reg::RSP);
+    }
+    if (frame_size)
+        out->emit(Op::SUB, Reg::RSP, Operand::imm(frame_size));
+    depth = 0;
+
+    for (size_t i = 0; i < fn.params.size(); i++) {
+        Operand dst = gen_lval(fn.params[i]);
+        if (i < argreg.size()) {
+            out->emit(Op::MOV, dst, argreg[i]);
+            continue;
+        }
+        // 7個目からの引数は戻り番地の上に置かれている
+        out->emit(Op::MOV, Reg::RAX, stack_param(i));
+        out->emit(Op::MOV, dst, Reg::RAX);
+    }
+
+    cur_fn = &fn;
+    if (opts.tailcall) {
+        body_label = make_label("body");
+        out->emit_label(body_label);
+    }
+    for (auto node : fn.code)
+        gen_stmt(node);
+
+    // エピローグ
+    // returnは文の中にしかないので、ここに来るときは何も積んでいない
+    out->emit_label(return_label);
+    if (!frameless) {
+        out->emit(Op::MOV, Reg::RSP, Reg::RBP);
+        out->emit(Op::POP, Reg::RBP);
+    } else if (frame_size) {
+        out->emit(Op::ADD, Reg::RSP, Operand::imm(frame_size));
+    }
+    out->emit(Op::RET);
+}
+
+// 1つの関数を命令列に変換する
+static void gen_func_to(const Function &fn, AsmFunc &asmfn) {
+    out = &asmfn;
+    out->name = fn.name;
+    return_label = make_label("return");
+
+    if (opts.regalloc) {
+        IRFunc irf = gen_ir(fn);
+        run_passes(irf);
+        alloc_regs(irf);
+        gen_ir_func(irf);
+    } else {
+        gen_func(fn);
+    }
+
+    if (opts.peephole)
+        asmfn.peephole_removed = peephole(asmfn);
+}
+
+// 各スレッドは次に処理する番号を共有のカウンタから取っていく
+void parallel_for(size_t n, int jobs, const std::function<void(size_t)> &f) {
+    std::atomic<size_t> next{0};
+    auto worker = [&] {
+        for (size_t i; (i = next++) < n;)
+            f(i);
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < jobs && size_t(i) < n; i++)
+        threads.emplace_back(worker);
+    worker();
+    for (auto &t : threads)
+        t.join();
+}
+
+// 関数ごとに別々の命令列を作るので、スレッドで分担しても結果は逐次の場合と同じになる
+std::vector<AsmFunc> codegen(const std::vector<Function> &prog) {
+    std::vector<AsmFunc> funcs(prog.size());
+    parallel_for(prog.size(), opts.jobs, [&](size_t i) { gen_func_to(prog[i], funcs[i]); });
+    return funcs;
 }
@@ -0,0 +1,278 @@
+#include "9cc.h"
+
+#include <memory>
+#include <set>
+#include <tuple>
+
+// 共通部分式の削除 (値番号付け)
+// 同じ値になる式に同じ番号を振り、2回目以降はその値を入れておいた変数を読む
+//   y = a * b + 1; z = a * b;  =>  y = (t = a * b) + 1; z = t;
+// 変数には代入のたびに新しい番号を振るので、代入の前後の式は別の値になる
+// ifの中では、ifより前の式の値を使える。ループの中で代入する変数は、ループの入口で新しい番号にする
+// ifの枝やループの本体で表に加えたものは、抜けるときに変更の記録を逆に辿って取り消す
+// (枝ごとに表をコピーすると、表の大きさ×ifの数の手間がかかる)
+
+// 式の値番号を決める組 (kind, 左辺の番号, 右辺の番号, 定数)
+using Key = std::tuple<NodeKind, int, int, int>;
+
+struct Entry {
+    int vn;
+    Node *first; // 最初に計算する場所
+    int temp;    // 値を入れておく変数のオフセット。まだなければ-1
+};
+
+static Arena *arena;
+static Function *fn;
+static std::vector<std::unique_ptr<Entry>> entries;
+static int next_vn;
+static int removed;
+
+static int new_vn() { return next_vn++; }
+
+struct State {
+    std::map<int, int> vars;       // 変数のオフセット => 今の値番号
+    std::map<Key, Entry *> values; // 今使える式
+
+    // 取り消すための変更の記録
+    std::vector<std::pair<int, std::optional<int>>> var_log; // (オフセット, 前の値番号)
+    std::vector<Key> value_log;                               // 加えた式
+};
+
+// 変更の記録の位置
+using Mark = std::pair<size_t, size_t>;
+
+static Mark mark(const State &st) { return {st.var_log.size(), st.value_log.size()}; }
+
+// markの後の変更を取り消す
+static void rollback(State &st, Mark m) {
+    while (st.var_log.size() > m.first) {
+        auto [offset, vn] = st.var_log.back();
+        st.var_log.pop_back();
+        if (vn)
+            st.vars[offset] = *vn;
+        else
+            st.vars.erase(offset);
+    }
+    while (st.value_log.size() > m.second) {
+        st.values.erase(st.value_log.back());
+        st.value_log.pop_back();
+    }
+}
+
+static int set_var(State &st, int offset, int vn) {
+    auto it = st.vars.find(offset);
+    if (it == st.vars.end()) {
+        st.var_log.push_back({offset, std::nullopt});
+        st.vars[offset] = vn;
+    } else {
+        st.var_log.push_back({offset, it->second});
+        it->second = vn;
+    }
+    return vn;
+}
+
+static int add_value(State &st, const Key &key, Node *node) {
+    entries.push_back(std::make_unique<Entry>(Entry{new_vn(), node, -1}));
+    st.values[key] = entries.back().get();
+    st.value_log.push_back(key);
+    return entries.back()->vn;
+}
+
+static int var_vn(State &st, int offset) {
+    auto it = st.vars.find(offset);
+    if (it != st.vars.end())
+        return it->second;
+    return set_var(st, offset, new_vn());
+}
+
+// 代入される変数のオフセットを集める
+static void assigned_vars(Node *node, std::set<int> &vars) {
+    if (!node)
+        return;
+    if (node->kind == NodeKind::ND_ASSIGN)
+        vars.insert(node->lhs->offset);
+    if (node->kind == NodeKind::ND_FUNCALL)
+        for (auto arg : *(node->args))
+            assigned_vars(arg, vars);
+    if (node->kind == NodeKind::ND_BLOCK)
+        for (auto stmt : *(node->body))
+            assigned_vars(stmt, vars);
+    for (Node *child : {node->lhs, node->rhs, node->cond, node->then, node->els, node->init, node->inc})
+        assigned_vars(child, vars);
+}
+
+static void kill(State &st, Node *node) {
+    std::set<int> vars;
+    assigned_vars(node, vars);
+    for (int offset : vars)
+        set_var(st, offset, new_vn());
+}
+
+static int count_nodes(Node *node) {
+    if (!node)
+        return 0;
+    return 1 + count_nodes(node->lhs) + count_nodes(node->rhs);
+}
+
+static Node *new_lvar(int offset) {
+    Node *node = alloc_node(*arena, NodeKind::ND_LVAR);
+    node->offset = offset;
+    return node;
+}
+
+// 2回目に現れた式を、最初の場所で値を入れておいた変数の読み出しにする
+static void reuse(Entry &e, Node *node) {
+    if (e.temp < 0) {
+        fn->stack_size += 8;
+        e.temp = fn->stack_size;
+        Node *expr = alloc_node(*arena, e.first->kind);
+        *expr = *e.first;
+        e.first->kind = NodeKind::ND_ASSIGN;
+        e.first->lhs = new_lvar(e.temp);
+        e.first->rhs = expr;
+    }
+    removed += count_nodes(node) - 1;
+    node->kind = NodeKind::ND_LVAR;
+    node->offset = e.temp;
+    node->lhs = nullptr;
+    node->rhs = nullptr;
+}
+
+static bool is_commutative(NodeKind kind) {
+    return kind == NodeKind::ND_ADD || kind == NodeKind::ND_MUL || kind == NodeKind::ND_EQ ||
+           kind == NodeKind::ND_NE;
+}
+
+static int number(Node *node, State &st, bool &effect, Entry *&match);
+
+// 式の値番号を返し、前に計算した式と同じなら置き換える
+static int number_reuse(Node *node, State &st, bool &effect) {
+    Entry *match = nullptr;
+    int vn = number(node, st, effect, match);
+    if (match)
+        reuse(*match, node);
+    return vn;
+}
+
+// 式を評価順に辿って値番号を返す
+// 代入や関数呼び出しを含む式は、消すと副作用もなくなるので使い回さない (effectを真にする)
+// 前に計算した式と同じ式は、すぐには置き換えずmatchに入れて返す。外側の式も同じなら
+// 外側だけを置き換えるので、内側の式の値を入れておくだけの変数を作らずに済む
+//   x = a * b * c; y = a * b * c;  =>  x = (t = a * b * c); y = t;
+static int number(Node *node, State &st, bool &effect, Entry *&match) {
+    switch (node->kind) {
+    case NodeKind::ND_NUM: {
+        Key key = {node->kind, 0, 0, node->val};
+        auto it = st.values.find(key);
+        if (it != st.values.end())
+            return it->second->vn;
+        return add_value(st, key, node);
+    }
+    case NodeKind::ND_LVAR:
+        return var_vn(st, node->offset);
+    case NodeKind::ND_ASSIGN:
+        // 代入した変数は右辺と同じ値になる
+        effect = true;
+        return set_var(st, node->lhs->offset, number_reuse(node->rhs, st, effect));
+    case NodeKind::ND_FUNCALL:
+        effect = true;
+        for (auto arg : *(node->args))
+            number_reuse(arg, st, effect);
+        return new_vn();
+    case NodeKind::ND_COMMA:
+        number_reuse(node->lhs, st, effect);
+        return number_reuse(node->rhs, st, effect);
+    default:
+        break;
+    }
+
+    bool e = false;
+    Entry *lmatch = nullptr, *rmatch = nullptr;
+    int l = number(node->lhs, st, e, lmatch);
+    int r = number(node->rhs, st, e, rmatch);
+    if (is_commutative(node->kind) && r < l)
+        std::swap(l, r);
+    Key key = {node->kind, l, r, 0};
+    auto it = e ? st.values.end() : st.values.find(key);
+    if (it != st.values.end()) {
+        match = it->second;
+        return it->second->vn;
+    }
+
+    // この式は置き換えないので、内側の同じ式を置き換える
+    if (lmatch)
+        reuse(*lmatch, node->lhs);
+    if (rmatch)
+        reuse(*rmatch, node->rhs);
+    if (e) {
+        effect = true;
+        return new_vn();
+    }
+    return add_value(st, key, node);
+}
+
+static int number(Node *node, State &st) {
+    bool effect = false;
+    return number_reuse(node, st, effect);
+}
+
+static void number_stmt(Node *node, State &st) {
+    if (!node)
+        return;
+    switch (node->kind) {
+    case NodeKind::ND_RETURN:
+        number(node->lhs, st);
+        return;
+    case NodeKind::ND_IF: {
+        number(node->cond, st);
+        // 条件までに計算した値はどちらの枝でも使えるが、枝の中で計算した値はifの後では使えない
+        Mark m = mark(st);
+        number_stmt(node->then, st);
+        rollback(st, m);
+        number_stmt(node->els, st);
+        rollback(st, m);
+        kill(st, node->then);
+        kill(st, node->els);
+        return;
+    }
+    case NodeKind::ND_WHILE:
+    case NodeKind::ND_FOR: {
+        if (node->init)
+            number(node->init, st);
+        // 2周目以降は、ループの中での代入の後の値になっている
+        kill(st, node->cond);
+        kill(st, node->then);
+        kill(st, node->inc);
+        Mark m = mark(st);
+        if (node->cond)
+            number(node->cond, st);
+        number_stmt(node->then, st);
+        if (node->inc)
+            number(node->inc, st);
+        rollback(st, m);
+        return;
+    }
+    case NodeKind::ND_BLOCK:
+        for (auto stmt : *(node->body))
+            number_stmt(stmt, st);
+        return;
+    default:
+        number(node, st);
+        return;
+    }
+}
+
+void eliminate_common_subexprs(Function &f, Arena &a) {
+    arena = &a;
+    fn = &f;
+    entries.clear();
+    next_vn = 0;
+    removed = 0;
+
+    State st;
+    for (auto stmt : fn->code)
+        number_stmt(stmt, st);
+
+    if (opts.report)
+        fprintf(stderr, "cse: %s: %d nodes deduplicated\n", fn->name.c_str(), removed);
+}
@@ -0,0 +1,300 @@
+#include "9cc.h"
+
+#include <set>
+
+// 不要なコードの削除
+// - returnや抜けられないループの後ろの文と、条件が定数のifの通らない枝を消す
+// - 副作用のない式文は、副作用のある部分だけを残す
+//     x + f(); => f();   x * 2; => (消える)
+// - 後で読まれない変数への代入は、右辺の計算だけにする
+//     x = a + 1; x = 2; return x;  =>  x = 2; return x;
+// 中間表現の-fdceと違い、構文木の上で行うのでどのコード生成でも効く
+
+using Live = std::set<int>;
+
+static Arena *arena;
+static int removed_stmts;
+static int removed_stores;
+
+static Node *empty_block() {
+    Node *node = alloc_node(*arena, NodeKind::ND_BLOCK);
+    node->body = alloc_node_vec(*arena, {});
+    return node;
+}
+
+// 文の後ろに進まないか
+static bool ends(Node *node) {
+    if (!node)
+        return false;
+    switch (node->kind) {
+    case NodeKind::ND_RETURN:
+        return true;
+    case NodeKind::ND_IF:
+        return ends(node->then) && ends(node->els);
+    case NodeKind::ND_WHILE:
+    case NodeKind::ND_FOR:
+        // breakはないので、条件のないループはreturnでしか抜けない
+        return !node->cond || (node->cond->kind == NodeKind::ND_NUM && node->cond->val != 0);
+    case NodeKind::ND_BLOCK:
+        return std::any_of(node->body->begin(), node->body->end(), ends);
+    default:
+        return false;
+    }
+}
+
+// 値を捨てる式から副作用のある部分だけを取り出す。何も残らなければnullptrを返す
+static Node *discard(Node *node) {
+    if (!node)
+        return nullptr;
+    switch (node->kind) {
+    case NodeKind::ND_NUM:
+    case NodeKind::ND_LVAR:
+        return nullptr;
+    case NodeKind::ND_ASSIGN:
+    case NodeKind::ND_FUNCALL:
+        return node;
+    default:
+        break;
+    }
+    // 左辺から順に評価する
+    Node *lhs = discard(node->lhs);
+    Node *rhs = discard(node->rhs);
+    if (!lhs || !rhs)
+        return lhs ? lhs : rhs;
+    node->kind = NodeKind::ND_COMMA;
+    node->lhs = lhs;
+    node->rhs = rhs;
+    return node;
+}
+
+static Node *clean_stmt(Node *node);
+
+static void clean_block(std::vector<Node *> &stmts) {
+    std::vector<Node *> body;
+    for (size_t i = 0; i < stmts.size(); i++) {
+        if (Node *s = clean_stmt(stmts[i]))
+            body.push_back(s);
+        if (!body.empty() && ends(body.back())) {
+            removed_stmts += stmts.size() - i - 1;
+            break;
+        }
+    }
+    stmts = body;
+}
+
+// 文を掃除する。文が丸ごと消える場合はnullptrを返す
+static Node *clean_stmt(Node *node) {
+    if (!node)
+        return nullptr;
+
+    switch (node->kind) {
+    case NodeKind::ND_RETURN:
+        return node;
+    case NodeKind::ND_IF:
+        if (node->cond->kind == NodeKind::ND_NUM) {
+            removed_stmts++;
+            return clean_stmt(node->cond->val ? node->then : node->els);
+        }
+        node->then = clean_stmt(node->then);
+        node->els = clean_stmt(node->els);
+        if (!node->then && !node->els) {
+            removed_stmts++;
+            return discard(node->cond);
+        }
+        if (!node->then)
+            node->then = empty_block();
+        return node;
+    case NodeKind::ND_WHILE:
+    case NodeKind::ND_FOR:
+        if (node->cond && node->cond->kind == NodeKind::ND_NUM && node->cond->val == 0) {
+            removed_stmts++;
+            return discard(node->init);
+        }
+        node->then = clean_stmt(node->then);
+        if (!node->then)
+            node->then = empty_block();
+        return node;
+    case NodeKind::ND_BLOCK: {
+        std::vector<Node *> body(node->body->begin(), node->body->end());
+        clean_block(body);
+        if (body.empty())
+            return nullptr;
+        node->body = alloc_node_vec(*arena, body);
+        return node;
+    }
+    default:
+        if (Node *expr = discard(node))
+            return expr;
+        removed_stmts++;
+        return nullptr;
+    }
+}
+
+// 読む変数をすべて集める
+static void reads(Node *node, Live &live) {
+    if (!node)
+        return;
+    switch (node->kind) {
+    case NodeKind::ND_LVAR:
+        live.insert(node->offset);
+        return;
+    case NodeKind::ND_ASSIGN:
+        reads(node->rhs, live);
+        return;
+    case NodeKind::ND_FUNCALL:
+        for (auto arg : *(node->args))
+            reads(arg, live);
+        return;
+    case NodeKind::ND_BLOCK:
+        for (auto stmt : *(node->body))
+            reads(stmt, live);
+        return;
+    default:
+        break;
+    }
+    for (Node *child : {node->lhs, node->rhs, node->cond, node->then, node->els, node->init, node->inc})
+        reads(child, live);
+}
+
+// 式を評価の逆順に辿り、liveを式の後で生きている変数から式の前で生きている変数にする
+// 生きていない変数への代入は右辺だけにする
+static void live_expr(Node *node, Live &live) {
+    if (!node)
+        return;
+    switch (node->kind) {
+    case NodeKind::ND_NUM:
+        return;
+    case NodeKind::ND_LVAR:
+        live.insert(node->offset);
+        return;
+    case NodeKind::ND_ASSIGN:
+        if (!live.count(node->lhs->offset)) {
+            // 代入式の値は右辺の値なので、式の中の代入でもそのまま置き換えられる
+            *node = *node->rhs;
+            removed_stores++;
+            live_expr(node, live);
+            return;
+        }
+        live.erase(node->lhs->offset);
+        live_expr(node->rhs, live);
+        return;
+    case NodeKind::ND_FUNCALL:
+        for (auto it = node->args->rbegin(); it != node->args->rend(); ++it)
+            live_expr(*it, live);
+        return;
+    default:
+        live_expr(node->rhs, live);
+        live_expr(node->lhs, live);
+        return;
+    }
+}
+
+static void live_stmt(Node *node, Live &live) {
+    if (!node)
+        return;
+    switch (node->kind) {
+    case NodeKind::ND_RETURN:
+        live.clear();
+        live_expr(node->lhs, live);
+        return;
+    case NodeKind::ND_IF: {
+        Live els = live;
+        live_stmt(node->then, live);
+        live_stmt(node->els, els);
+        live.insert(els.begin(), els.end());
+        live_expr(node->cond, live);
+        return;
+    }
+    case NodeKind::ND_WHILE:
+    case NodeKind::ND_FOR: {
+        // ループの中では、ループの後で生きている変数に加えてループの中で読む変数をすべて生きているとみなす
+        // 次の周回で読まれる変数を取りこぼさないための、大きめの近似
+        reads(node->cond, live);
+        reads(node->then, live);
+        reads(node->inc, live);
+        Live body = live;
+        live_expr(node->inc, body);
+        live_stmt(node->then, body);
+        live_expr(node->cond, body);
+        live_expr(node->init, live);
+        return;
+    }
+    case NodeKind::ND_BLOCK:
+        for (auto it = node->body->rbegin(); it != node->body->rend(); ++it)
+            live_stmt(*it, live);
+        return;
+    default:
+        live_expr(node, live);
+        return;
+    }
+}
+
+void eliminate_dead_code(Function &fn, Arena &a) {
+    arena = &a;
+    removed_stmts = 0;
+    removed_stores = 0;
+
+    // 代入を消すと右辺だけの式文が残り、それを消すと前の代入も要らなくなることがある
+    for (int stores = -1; stores != removed_stores;) {
+        stores = removed_stores;
+        clean_block(fn.code);
+        Live live;
+        for (auto it = fn.code.rbegin(); it != fn.code.rend(); ++it)
+            live_stmt(*it, live);
+    }
+
+    if (opts.report)
+        fprintf(stderr, "dead-code: %s: %d statements, %d stores removed\n", fn.name.c_str(), removed_stmts,
+                removed_stores);
+}
+
+static void called_functions(Node *node, std::vector<std::string_view> &names) {
+    if (!node)
+        return;
+    if (node->kind == NodeKind::ND_FUNCALL) {
+        names.push_back(node->funcname);
+        for (auto arg : *(node->args))
+            called_functions(arg, names);
+    }
+    if (node->kind == NodeKind::ND_BLOCK)
+        for (auto stmt : *(node->body))
+            called_functions(stmt, names);
+    for (Node *child : {node->lhs, node->rhs, node->cond, node->then, node->els, node->init, node->inc})
+        called_functions(child, names);
+}
+
+void remove_unused_functions(std::vector<Function> &prog) {
+    // 関数はすべて.globalで出力するので、アセンブリやオブジェクトファイルでは
+    // リンクする他のファイルから呼ばれうる。mainだけが入口になるのはその場で実行するときだけ
+    if (!opts.jit && !opts.vm)
+        return;
+    std::map<std::string_view, const Function *> funcs;
+    for (auto &fn : prog)
+        funcs[fn.name] = &fn;
+    if (funcs.count("main") == 0)
+        return;
+
+    // mainから呼び出しを辿る
+    std::set<std::string> used;
+    std::vector<std::string_view> work = {"main"};
+    while (!work.empty()) {
+        std::string_view name = work.back();
+        work.pop_back();
+        auto it = funcs.find(name);
+        if (it == funcs.end() || !used.insert(std::string(name)).second)
+            continue;
+        for (auto stmt : it->second->code)
+            called_functions(stmt, work);
+    }
+
+    std::vector<Function> live;
+    for (auto &fn : prog) {
+        if (used.count(fn.name)) {
+            live.push_back(std::move(fn));
+            continue;
+        }
+        if (opts.report)
+            fprintf(stderr, "dead-code: %s: unused function removed\n", fn.name.c_str());
+    }
+    prog = std::move(live);
+}
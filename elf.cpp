@@ -0,0 +1,146 @@
+#include "9cc.h"
+
+#include <elf.h>
+
+// 機械語をELF64の再配置可能オブジェクトファイルとして書き出す
+
+// セクション番号
+enum {
+    SEC_NULL,
+    SEC_TEXT,
+    SEC_SYMTAB,
+    SEC_STRTAB,
+    SEC_RELA,
+    SEC_SHSTRTAB,
+    SEC_NOTE,
+    NUM_SECTIONS,
+};
+
+template <class T> static void put(Emitter &out, const T &v) {
+    out << std::string_view(reinterpret_cast<const char *>(&v), sizeof(v));
+}
+
+// 文字列表に名前を追加し、その位置を返す
+static uint32_t add_str(Emitter &tab, std::string_view s) {
+    uint32_t pos = tab.size();
+    tab << s << '\0';
+    return pos;
+}
+
+void emit_obj(const std::vector<AsmFunc> &funcs, Emitter &out) {
+    MachineCode mc = assemble(funcs);
+
+    // シンボル表。ローカルシンボルはヌルシンボルだけで、残りはすべてグローバル
+    Emitter symtab, strtab, rela, shstrtab;
+    strtab << '\0';
+    put(symtab, Elf64_Sym{});
+    int first_global = 1;
+
+    for (auto &f : mc.funcs) {
+        Elf64_Sym sym{};
+        sym.st_name = add_str(strtab, f.name);
+        sym.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+        sym.st_shndx = SEC_TEXT;
+        sym.st_value = f.offset;
+        sym.st_size = f.size;
+        put(symtab, sym);
+    }
+
+    // 外部の関数は未定義シンボルにして、呼び出し位置に再配置を付ける
+    std::map<std::string_view, int> externs;
+    int nsyms = 1 + mc.funcs.size();
+    for (auto &r : mc.relocs) {
+        if (externs.count(r.sym) == 0) {
+            Elf64_Sym sym{};
+            sym.st_name = add_str(strtab, r.sym);
+            sym.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE);
+            sym.st_shndx = SHN_UNDEF;
+            put(symtab, sym);
+            externs[r.sym] = nsyms++;
+        }
+
+        Elf64_Rela rel{};
+        rel.r_offset = r.offset;
+        rel.r_info = ELF64_R_INFO(externs[r.sym], R_X86_64_PLT32);
+        rel.r_addend = -4;
+        put(rela, rel);
+    }
+
+    // セクションを並べる位置を決める
+    const char *names[NUM_SECTIONS] = {"",          ".text",      ".symtab",           ".strtab",
+                                       ".rela.text", ".shstrtab", ".note.GNU-stack"};
+    uint32_t name_pos[NUM_SECTIONS];
+    for (int i = 0; i < NUM_SECTIONS; i++)
+        name_pos[i] = add_str(shstrtab, names[i]);
+
+    const Emitter *contents[NUM_SECTIONS] = {nullptr, &mc.text, &symtab, &strtab, &rela, &shstrtab, nullptr};
+    size_t offsets[NUM_SECTIONS] = {};
+    size_t pos = sizeof(Elf64_Ehdr);
+    for (int i = 0; i < NUM_SECTIONS; i++) {
+        pos = (pos + 15) & ~size_t(15);
+        offsets[i] = pos;
+        if (contents[i])
+            pos += contents[i]->size();
+    }
+    size_t shoff = (pos + 7) & ~size_t(7);
+
+    Elf64_Ehdr ehdr{};
+    std::copy(ELFMAG, ELFMAG + SELFMAG, ehdr.e_ident);
+    ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    ehdr.e_type = ET_REL;
+    ehdr.e_machine = EM_X86_64;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_shoff = shoff;
+    ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+    ehdr.e_shentsize = sizeof(Elf64_Shdr);
+    ehdr.e_shnum = NUM_SECTIONS;
+    ehdr.e_shstrndx = SEC_SHSTRTAB;
+    put(out, ehdr);
+
+    for (int i = 0; i < NUM_SECTIONS; i++) {
+        if (!contents[i])
+            continue;
+        out.align(16);
+        out << contents[i]->str();
+    }
+    out.align(8);
+
+    Elf64_Shdr shdrs[NUM_SECTIONS] = {};
+    for (int i = 0; i < NUM_SECTIONS; i++) {
+        shdrs[i].sh_name = name_pos[i];
+        shdrs[i].sh_offset = i == SEC_NULL ? 0 : offsets[i];
+        shdrs[i].sh_size = contents[i] ? contents[i]->size() : 0;
+        shdrs[i].sh_addralign = 1;
+    }
+    shdrs[SEC_TEXT].sh_type = SHT_PROGBITS;
+    shdrs[SEC_TEXT].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+    shdrs[SEC_TEXT].sh_addralign = 16;
+
+    shdrs[SEC_SYMTAB].sh_type = SHT_SYMTAB;
+    shdrs[SEC_SYMTAB].sh_link = SEC_STRTAB;
+    shdrs[SEC_SYMTAB].sh_info = first_global;
+    shdrs[SEC_SYMTAB].sh_entsize = sizeof(Elf64_Sym);
+    shdrs[SEC_SYMTAB].sh_addralign = 8;
+
+    shdrs[SEC_STRTAB].sh_type = SHT_STRTAB;
+
+    shdrs[SEC_RELA].sh_type = SHT_RELA;
+    shdrs[SEC_RELA].sh_flags = SHF_INFO_LINK;
+    shdrs[SEC_RELA].sh_link = SEC_SYMTAB;
+    shdrs[SEC_RELA].sh_info = SEC_TEXT;
+    shdrs[SEC_RELA].sh_entsize = sizeof(Elf64_Rela);
+    shdrs[SEC_RELA].sh_addralign = 8;
+
+    shdrs[SEC_SHSTRTAB].sh_type = SHT_STRTAB;
+
+    // スタックを実行可能にしないことをリンカに伝える
+    shdrs[SEC_NOTE].sh_type = SHT_PROGBITS;
+    shdrs[SEC_NOTE].sh_offset = offsets[SEC_NOTE];
+
+    shdrs[SEC_NULL].sh_addralign = 0;
+    for (auto &sh : shdrs)
+        put(out, sh);
+}
@@ -0,0 +1,162 @@
+#include "9cc.h"
+
+#include <unistd.h>
+
+static const char *reg_names[] = {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+                                  "r8",  "r9",  "r10", "r11", "r12", "r13", "r14", "r15"};
+
+const char *reg_name(Reg reg) { return reg_names[int(reg)]; }
+
+Emitter::Emitter(Emitter &&other) noexcept : buf(other.buf), len(other.len), cap(other.cap) {
+    other.buf = nullptr;
+    other.len = other.cap = 0;
+}
+
+Emitter &Emitter::operator=(Emitter &&other) noexcept {
+    if (this != &other) {
+        free(buf);
+        buf = other.buf;
+        len = other.len;
+        cap = other.cap;
+        other.buf = nullptr;
+        other.len = other.cap = 0;
+    }
+    return *this;
+}
+
+void Emitter::grow(size_t need) {
+    size_t new_cap = std::max<size_t>(cap * 2, 4096);
+    while (new_cap < need)
+        new_cap *= 2;
+    buf = static_cast<char *>(realloc(buf, new_cap));
+    if (!buf)
+        error("メモリが足りません");
+    cap = new_cap;
+}
+
+Emitter &Emitter::operator<<(long n) {
+    // 下の桁から一時バッファに詰めて、まとめてコピーする
+    char tmp[24];
+    char *end = tmp + sizeof(tmp);
+    char *p = end;
+    unsigned long u = n < 0 ? -(unsigned long)n : n;
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (n < 0)
+        *--p = '-';
+    return *this << std::string_view(p, end - p);
+}
+
+Emitter &Emitter::operator<<(const Operand &op) {
+    switch (op.kind) {
+    case Operand::NONE:
+        return *this;
+    case Operand::REG:
+        return *this << op.reg;
+    case Operand::IMM:
+        return *this << op.val;
+    case Operand::MEM:
+        *this << "QWORD PTR [" << op.reg;
+        if (op.scale)
+            *this << '+' << op.index << '*' << int(op.scale);
+        if (op.val > 0)
+            *this << '+' << op.val;
+        else if (op.val < 0)
+            *this << op.val;
+        return *this << ']';
+    }
+    return *this;
+}
+
+static const char *op_names[] = {"",    "mov",  "movzb", "lea", "add", "sub", "imul", "imul", "and",
+                                 "shl", "shr",  "sar",   "cqo", "idiv", "cmp", "set", "push", "pop",
+                                 "jmp", "j",    "call",  "jmp", "ret"};
+
+static const char *cond_name(Cond cc) {
+    switch (cc) {
+    case Cond::E:
+        return "e";
+    case Cond::NE:
+        return "ne";
+    case Cond::L:
+        return "l";
+    case Cond::GE:
+        return "ge";
+    case Cond::LE:
+        return "le";
+    case Cond::G:
+        return "g";
+    }
+    return "";
+}
+
+// ".L.<name>.<fn>.<id>" という形のラベル。idは関数ごとに振る
+static void print_label(Emitter &out, const AsmFunc &fn, int label) {
+    out << ".L." << fn.labels[label] << '.' << fn.name << '.' << label;
+}
+
+static void print_insn(Emitter &out, const AsmFunc &fn, const Insn &insn) {
+    if (insn.op == Op::LABEL) {
+        print_label(out, fn, insn.label);
+        out << ":\n";
+        return;
+    }
+
+    out << "  " << op_names[int(insn.op)];
+    switch (insn.op) {
+    case Op::SETCC:
+        out << cond_name(insn.cc) << " al\n";
+        return;
+    case Op::MOVZB:
+        out << ' ' << insn.a << ", al\n";
+        return;
+    case Op::JCC:
+        out << cond_name(insn.cc);
+        [[fallthrough]];
+    case Op::JMP:
+        out << ' ';
+        print_label(out, fn, insn.label);
+        out << '\n';
+        return;
+    case Op::CALL:
+    case Op::TAILCALL:
+        out << ' ' << insn.sym << '\n';
+        return;
+    default:
+        break;
+    }
+    if (insn.a.kind != Operand::NONE)
+        out << ' ' << insn.a;
+    if (insn.b.kind != Operand::NONE)
+        out << ", " << insn.b;
+    out << '\n';
+}
+
+void emit_asm(const std::vector<AsmFunc> &funcs, Emitter &out) {
+    // アセンブリの前半部分を出力
+    out << ".intel_syntax noprefix\n";
+    for (auto &fn : funcs) {
+        out << ".global " << fn.name << '\n';
+        out << fn.name << ":\n";
+        for (auto &insn : fn.insns)
+            print_insn(out, fn, insn);
+    }
+}
+
+void Emitter::write_to(int fd) const {
+    size_t off = 0;
+    while (off < len) {
+        ssize_t n = write(fd, buf + off, len - off);
+        if (n < 0)
+            error("書き込みに失敗しました");
+        off += n;
+    }
+}
+
+size_t Emitter::copy_to(char *dst, size_t size) const {
+    size_t n = std::min(size, len);
+    std::copy(buf, buf + n, dst);
+    return n;
+}
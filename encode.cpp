@@ -0,0 +1,259 @@
+#include "9cc.h"
+
+// 命令列をx86-64の機械語に変換する
+// 使う命令はすべて64bitなので、REX.Wプレフィックスを常に付ける
+
+static Emitter *out;
+
+static bool is_int8(long v) { return -128 <= v && v <= 127; }
+static bool is_int32(long v) { return INT32_MIN <= v && v <= INT32_MAX; }
+
+static void byte(int b) { out->bytes<uint8_t>(b); }
+
+static int num(Reg reg) { return int(reg); }
+
+// REX.Wプレフィックス。rはModRMのregフィールド、rmはr/mフィールドに入る
+static void rex(int r, const Operand &rm) {
+    int x = rm.kind == Operand::MEM && rm.scale ? num(rm.index) >> 3 : 0;
+    byte(0x48 | (r >> 3) << 2 | x << 1 | num(rm.reg) >> 3);
+}
+
+static int scale_bits(int scale) { return scale == 8 ? 3 : scale == 4 ? 2 : scale == 2 ? 1 : 0; }
+
+// ModRMと、必要ならSIBとディスプレースメント
+static void modrm(int r, const Operand &rm) {
+    int base = num(rm.reg) & 7;
+    if (rm.kind == Operand::REG) {
+        byte(0xc0 | (r & 7) << 3 | base);
+        return;
+    }
+
+    // rbpとr13はmod=00だとrip相対になるので、0でもディスプレースメントを付ける
+    long disp = rm.val;
+    int mod = (disp == 0 && base != 5) ? 0 : is_int8(disp) ? 1 : 2;
+    if (rm.scale) {
+        // r/mを100にしてSIBバイトでインデックスを指定する (rspはインデックスにできない)
+        byte(mod << 6 | (r & 7) << 3 | 4);
+        byte(scale_bits(rm.scale) << 6 | (num(rm.index) & 7) << 3 | base);
+    } else {
+        byte(mod << 6 | (r & 7) << 3 | base);
+        // rspとr12はSIBバイトが必要になる
+        if (base == 4)
+            byte(0x24);
+    }
+    if (mod == 1)
+        out->bytes<int8_t>(disp);
+    else if (mod == 2)
+        out->bytes<int32_t>(disp);
+}
+
+static void op_rm(std::initializer_list<uint8_t> opcode, int r, const Operand &rm) {
+    rex(r, rm);
+    for (uint8_t b : opcode)
+        byte(b);
+    modrm(r, rm);
+}
+
+static void check_imm(const Operand &imm) {
+    if (!is_int32(imm.val))
+        error("即値が32bitに収まりません: %ld", imm.val);
+}
+
+// add, sub, and, cmp
+// code_mrはr/m, r、code_rmはr, r/mの形式のオペコード、digitは即値の形式で使う番号
+static void arith(int code_mr, int code_rm, int digit, const Operand &a, const Operand &b) {
+    if (b.kind == Operand::IMM) {
+        check_imm(b);
+        if (is_int8(b.val)) {
+            op_rm({0x83}, digit, a);
+            out->bytes<int8_t>(b.val);
+        } else {
+            op_rm({0x81}, digit, a);
+            out->bytes<int32_t>(b.val);
+        }
+        return;
+    }
+    if (b.kind == Operand::REG)
+        op_rm({uint8_t(code_mr)}, num(b.reg), a);
+    else
+        op_rm({uint8_t(code_rm)}, num(a.reg), b);
+}
+
+// shl, shr, sar。シフト量は即値だけ
+static void shift(int digit, const Operand &a, const Operand &b) {
+    op_rm({0xc1}, digit, a);
+    byte(b.val & 63);
+}
+
+static void mov(const Operand &a, const Operand &b) {
+    if (b.kind == Operand::IMM) {
+        if (a.kind == Operand::REG && !is_int32(b.val)) {
+            // movabs
+            byte(0x48 | num(a.reg) >> 3);
+            byte(0xb8 | (num(a.reg) & 7));
+            out->bytes<int64_t>(b.val);
+            return;
+        }
+        check_imm(b);
+        op_rm({0xc7}, 0, a);
+        out->bytes<int32_t>(b.val);
+        return;
+    }
+    if (b.kind == Operand::REG)
+        op_rm({0x89}, num(b.reg), a);
+    else
+        op_rm({0x8b}, num(a.reg), b);
+}
+
+// push/popはREX.Wなしで64bitになる。r8以降はREX.Bだけ付ける
+static void push_pop(int code, const Operand &a) {
+    if (a.kind == Operand::IMM) {
+        check_imm(a);
+        if (is_int8(a.val)) {
+            byte(0x6a);
+            out->bytes<int8_t>(a.val);
+        } else {
+            byte(0x68);
+            out->bytes<int32_t>(a.val);
+        }
+        return;
+    }
+    if (num(a.reg) >= 8)
+        byte(0x41);
+    byte(code | (num(a.reg) & 7));
+}
+
+struct Fixup {
+    size_t pos; // rel32の位置
+    int label;
+};
+
+static void encode_insn(const Insn &insn, std::vector<Fixup> &fixups, std::vector<Reloc> &calls) {
+    const Operand &a = insn.a;
+    const Operand &b = insn.b;
+
+    switch (insn.op) {
+    case Op::LABEL:
+        return;
+    case Op::MOV:
+        mov(a, b);
+        return;
+    case Op::MOVZB:
+        // movzx r64, al
+        op_rm({0x0f, 0xb6}, num(a.reg), Reg::RAX);
+        return;
+    case Op::LEA:
+        op_rm({0x8d}, num(a.reg), b);
+        return;
+    case Op::ADD:
+        arith(0x01, 0x03, 0, a, b);
+        return;
+    case Op::SUB:
+        arith(0x29, 0x2b, 5, a, b);
+        return;
+    case Op::AND:
+        arith(0x21, 0x23, 4, a, b);
+        return;
+    case Op::CMP:
+        arith(0x39, 0x3b, 7, a, b);
+        return;
+    case Op::IMUL:
+        if (b.kind == Operand::IMM) {
+            check_imm(b);
+            op_rm({0x69}, num(a.reg), a);
+            out->bytes<int32_t>(b.val);
+            return;
+        }
+        op_rm({0x0f, 0xaf}, num(a.reg), b);
+        return;
+    case Op::IMUL1:
+        op_rm({0xf7}, 5, a);
+        return;
+    case Op::SHL:
+        shift(4, a, b);
+        return;
+    case Op::SHR:
+        shift(5, a, b);
+        return;
+    case Op::SAR:
+        shift(7, a, b);
+        return;
+    case Op::CQO:
+        byte(0x48);
+        byte(0x99);
+        return;
+    case Op::IDIV:
+        op_rm({0xf7}, 7, a);
+        return;
+    case Op::SETCC:
+        // set<cc> al
+        byte(0x0f);
+        byte(0x90 | int(insn.cc));
+        byte(0xc0);
+        return;
+    case Op::PUSH:
+        push_pop(0x50, a);
+        return;
+    case Op::POP:
+        push_pop(0x58, a);
+        return;
+    case Op::JMP:
+        byte(0xe9);
+        break;
+    case Op::JCC:
+        byte(0x0f);
+        byte(0x80 | int(insn.cc));
+        break;
+    case Op::CALL:
+    case Op::TAILCALL:
+        // 呼び出しもジャンプも、関数の位置はrel32で同じように解決する
+        byte(insn.op == Op::CALL ? 0xe8 : 0xe9);
+        calls.push_back(Reloc{out->size(), insn.sym});
+        out->bytes<int32_t>(0);
+        return;
+    case Op::RET:
+        byte(0xc3);
+        return;
+    }
+
+    // ジャンプ先はまだ決まっていないことがあるので、関数の終わりで埋める
+    fixups.push_back(Fixup{out->size(), insn.label});
+    out->bytes<int32_t>(0);
+}
+
+MachineCode assemble(const std::vector<AsmFunc> &funcs) {
+    MachineCode mc;
+    out = &mc.text;
+
+    std::vector<Reloc> calls;
+    std::map<std::string_view, size_t> defined;
+    for (auto &fn : funcs) {
+        // 関数の先頭は16バイト境界に揃える
+        while (mc.text.size() % 16)
+            byte(0xcc);
+        size_t start = mc.text.size();
+
+        std::vector<size_t> labels(fn.labels.size());
+        std::vector<Fixup> fixups;
+        for (auto &insn : fn.insns) {
+            if (insn.op == Op::LABEL)
+                labels[insn.label] = mc.text.size();
+            encode_insn(insn, fixups, calls);
+        }
+        for (auto &f : fixups)
+            mc.text.patch<int32_t>(f.pos, labels[f.label] - (f.pos + 4));
+
+        mc.funcs.push_back(MachineCode::Symbol{fn.name, start, mc.text.size() - start});
+        defined[fn.name] = start;
+    }
+
+    // プログラム内の関数の呼び出しはここで解決し、残りは再配置として残す
+    for (auto &c : calls) {
+        auto it = defined.find(c.sym);
+        if (it != defined.end())
+            mc.text.patch<int32_t>(c.offset, it->second - (c.offset + 4));
+        else
+            mc.relocs.push_back(c);
+    }
+    return mc;
+}
@@ -0,0 +1,268 @@
+#include "9cc.h"
+
+#include <climits>
+#include <set>
+
+// 純粋な関数の呼び出しをコンパイル時に計算する
+// プログラムの外の関数を (間接的にも) 呼ばない関数は、引数が定数なら結果も定数になる
+//   fib(10) => 89
+// 木を辿って実際に計算し、手数の上限を超えたり、未定義の動作に当たったりしたらあきらめる
+
+// 1回の呼び出しの計算で辿るノードの数の上限
+static const long eval_budget = 1000000;
+// 関数呼び出しの深さの上限 (コンパイラ自身のスタックを守るため)
+static const int eval_max_depth = 1000;
+
+static std::map<std::string_view, Function *> funcs;
+static std::set<std::string_view> pure;
+
+static long steps;
+static int depth;
+static bool failed;
+
+struct Env {
+    std::vector<long> vars; // オフセット/8番目に変数を置く
+    std::vector<bool> set;  // 値を代入したか
+    bool returned = false;
+    long ret = 0;
+};
+
+static long fail() {
+    failed = true;
+    return 0;
+}
+
+static long call(const Function &fn, const std::vector<long> &args);
+
+static long eval(Node *node, Env &env) {
+    if (failed || ++steps > eval_budget)
+        return fail();
+
+    switch (node->kind) {
+    case NodeKind::ND_NUM:
+        return node->val;
+    case NodeKind::ND_LVAR:
+        // 初期化していない変数の値はわからない
+        if (!env.set[node->offset / 8])
+            return fail();
+        return env.vars[node->offset / 8];
+    case NodeKind::ND_ASSIGN: {
+        long val = eval(node->rhs, env);
+        env.vars[node->lhs->offset / 8] = val;
+        env.set[node->lhs->offset / 8] = true;
+        return val;
+    }
+    case NodeKind::ND_FUNCALL: {
+        std::vector<long> args;
+        for (auto arg : *(node->args))
+            args.push_back(eval(arg, env));
+        if (failed)
+            return 0;
+        return call(*funcs.at(node->funcname), args);
+    }
+    case NodeKind::ND_COMMA:
+        eval(node->lhs, env);
+        return eval(node->rhs, env);
+    default:
+        break;
+    }
+
+    // 実行時と同じく64bitで、オーバーフローしたら折り返す
+    unsigned long l = eval(node->lhs, env);
+    unsigned long r = eval(node->rhs, env);
+    if (failed)
+        return 0;
+    switch (node->kind) {
+    case NodeKind::ND_ADD:
+        return l + r;
+    case NodeKind::ND_SUB:
+        return l - r;
+    case NodeKind::ND_MUL:
+        return l * r;
+    case NodeKind::ND_DIV:
+        // 実行時にはトラップする
+        if (r == 0 || (long(l) == LONG_MIN && long(r) == -1))
+            return fail();
+        return long(l) / long(r);
+    case NodeKind::ND_EQ:
+        return l == r;
+    case NodeKind::ND_NE:
+        return l != r;
+    case NodeKind::ND_LT:
+        return long(l) < long(r);
+    case NodeKind::ND_LE:
+        return long(l) <= long(r);
+    default:
+        return fail();
+    }
+}
+
+static void exec(Node *node, Env &env) {
+    if (!node || env.returned || failed)
+        return;
+    switch (node->kind) {
+    case NodeKind::ND_RETURN:
+        env.ret = eval(node->lhs, env);
+        env.returned = true;
+        return;
+    case NodeKind::ND_IF:
+        if (eval(node->cond, env))
+            exec(node->then, env);
+        else
+            exec(node->els, env);
+        return;
+    case NodeKind::ND_WHILE:
+    case NodeKind::ND_FOR:
+        if (node->init)
+            eval(node->init, env);
+        while (!env.returned && !failed && (!node->cond || eval(node->cond, env))) {
+            exec(node->then, env);
+            if (!env.returned && node->inc)
+                eval(node->inc, env);
+        }
+        return;
+    case NodeKind::ND_BLOCK:
+        for (auto stmt : *(node->body))
+            exec(stmt, env);
+        return;
+    default:
+        eval(node, env);
+        return;
+    }
+}
+
+static long call(const Function &fn, const std::vector<long> &args) {
+    if (depth >= eval_max_depth)
+        return fail();
+    depth++;
+    Env env;
+    env.vars.resize(fn.stack_size / 8 + 1);
+    env.set.resize(fn.stack_size / 8 + 1);
+    for (size_t i = 0; i < fn.params.size() && i < args.size(); i++) {
+        env.vars[fn.params[i]->offset / 8] = args[i];
+        env.set[fn.params[i]->offset / 8] = true;
+    }
+    for (auto stmt : fn.code)
+        exec(stmt, env);
+    depth--;
+    // returnせずに関数の終わりに到達した場合は0を返す
+    return env.ret;
+}
+
+// 計算できればvalに結果を入れて真を返す
+static bool try_call(const Function &fn, const std::vector<long> &args, int &val) {
+    steps = 0;
+    depth = 0;
+    failed = false;
+    long ret = call(fn, args);
+    // ND_NUMに入らない値は置き換えない
+    if (failed || ret < INT32_MIN || INT32_MAX < ret)
+        return false;
+    val = ret;
+    return true;
+}
+
+static bool calls_impure(Node *node) {
+    if (!node)
+        return false;
+    if (node->kind == NodeKind::ND_FUNCALL) {
+        if (pure.count(node->funcname) == 0)
+            return true;
+        for (auto arg : *(node->args))
+            if (calls_impure(arg))
+                return true;
+        return false;
+    }
+    if (node->kind == NodeKind::ND_BLOCK) {
+        for (auto stmt : *(node->body))
+            if (calls_impure(stmt))
+                return true;
+        return false;
+    }
+    return calls_impure(node->lhs) || calls_impure(node->rhs) || calls_impure(node->cond) ||
+           calls_impure(node->then) || calls_impure(node->els) || calls_impure(node->init) ||
+           calls_impure(node->inc);
+}
+
+static const Function *caller;
+
+// 引数がすべて定数の純粋な関数の呼び出しを定数にする
+static void eval_calls(Node *node) {
+    if (!node)
+        return;
+    if (node->kind == NodeKind::ND_BLOCK) {
+        for (auto stmt : *(node->body))
+            eval_calls(stmt);
+        return;
+    }
+    for (Node *child : {node->lhs, node->rhs, node->cond, node->then, node->els, node->init, node->inc})
+        eval_calls(child);
+    if (node->kind != NodeKind::ND_FUNCALL)
+        return;
+
+    // 定数でない引数があっても、後ろの引数の中の呼び出しは計算できる
+    for (auto arg : *(node->args))
+        eval_calls(arg);
+    std::vector<long> args;
+    for (auto arg : *(node->args)) {
+        if (arg->kind != NodeKind::ND_NUM)
+            return;
+        args.push_back(arg->val);
+    }
+    if (pure.count(node->funcname) == 0)
+        return;
+
+    int val;
+    const Function &callee = *funcs.at(node->funcname);
+    if (!try_call(callee, args, val))
+        return;
+    if (opts.report)
+        fprintf(stderr, "const-eval: %s: %s = %d\n", caller->name.c_str(), callee.name.c_str(), val);
+    node->kind = NodeKind::ND_NUM;
+    node->val = val;
+    node->args = nullptr;
+}
+
+void eval_pure_calls(std::vector<Function> &prog, Arena &arena) {
+    funcs.clear();
+    pure.clear();
+    for (auto &fn : prog) {
+        funcs[fn.name] = &fn;
+        pure.insert(fn.name);
+    }
+
+    // 純粋でない関数を呼ぶ関数も純粋でない。変わらなくなるまで繰り返す
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (auto &fn : prog) {
+            if (pure.count(fn.name) == 0)
+                continue;
+            if (std::any_of(fn.code.begin(), fn.code.end(), calls_impure)) {
+                pure.erase(fn.name);
+                changed = true;
+            }
+        }
+    }
+
+    for (auto &fn : prog) {
+        caller = &fn;
+        for (auto stmt : fn.code)
+            eval_calls(stmt);
+    }
+
+    // mainが純粋なら、プログラム全体が1つの値になる
+    auto it = funcs.find("main");
+    if (it == funcs.end() || pure.count("main") == 0)
+        return;
+    Function &main = *it->second;
+    int val;
+    if (!main.params.empty() || !try_call(main, {}, val))
+        return;
+    if (opts.report)
+        fprintf(stderr, "const-eval: main = %d\n", val);
+    Node *ret = alloc_node(arena, NodeKind::ND_RETURN);
+    ret->lhs = alloc_node(arena, NodeKind::ND_NUM);
+    ret->lhs->val = val;
+    main.code = {ret};
+    main.stack_size = 0;
+}
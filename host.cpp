@@ -0,0 +1,22 @@
+#include "9cc.h"
+
+// プログラムから呼び出せるホスト側の関数
+// テストでリンクしているtmp2.oの関数と同じものを、型も同じにして用意しておく
+
+static int ret3() { return 3; }
+static int ret5() { return 5; }
+static int add(int x, int y) { return x + y; }
+static int sub(int x, int y) { return x - y; }
+static int add6(int a, int b, int c, int d, int e, int f) { return a + b + c + d + e + f; }
+static long sub8(long a, long b, long c, long d, long e, long f, long g, long h) {
+    return a + b + c + d + e + f - g - h;
+}
+
+const std::map<std::string_view, HostFunc> host_funcs = {
+    {"ret3", {(void *)ret3, 0, true}},
+    {"ret5", {(void *)ret5, 0, true}},
+    {"add", {(void *)add, 2, true}},
+    {"sub", {(void *)sub, 2, true}},
+    {"add6", {(void *)add6, 6, true}},
+    {"sub8", {(void *)sub8, 8, false}},
+};
@@ -0,0 +1,200 @@
+#include "9cc.h"
+
+// 関数のインライン展開
+// 本体が式文の並びとreturn 1つだけの小さい関数を、呼び出しの場所に式として埋め込む
+//   f(a, b) { x = a * 2; return x + b; }
+//   f(1, y) => (a' = 1, b' = y, x' = a' * 2, x' + b')
+// 呼び出された側の変数は、呼び出した側のフレームの後ろに新しく場所を取る
+
+// 本体のノード数がこれ以下の関数を展開する
+static const int inline_threshold = 40;
+
+static Arena *arena;
+static std::map<std::string_view, const Function *> funcs;
+
+static bool is_stmt(Node *node) {
+    switch (node->kind) {
+    case NodeKind::ND_RETURN:
+    case NodeKind::ND_IF:
+    case NodeKind::ND_WHILE:
+    case NodeKind::ND_FOR:
+    case NodeKind::ND_BLOCK:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static int count_nodes(Node *node) {
+    if (!node)
+        return 0;
+    int n = 1 + count_nodes(node->lhs) + count_nodes(node->rhs);
+    if (node->kind == NodeKind::ND_FUNCALL)
+        for (auto arg : *(node->args))
+            n += count_nodes(arg);
+    return n;
+}
+
+static bool calls(Node *node, std::string_view name) {
+    if (!node)
+        return false;
+    if (node->kind == NodeKind::ND_FUNCALL) {
+        if (node->funcname == name)
+            return true;
+        for (auto arg : *(node->args))
+            if (calls(arg, name))
+                return true;
+        return false;
+    }
+    return calls(node->lhs, name) || calls(node->rhs, name);
+}
+
+// 展開できる関数なら本体のノード数を返す。できなければ-1を返す
+static int inline_cost(const Function &fn) {
+    if (fn.code.empty() || fn.code.back()->kind != NodeKind::ND_RETURN)
+        return -1;
+    int cost = 0;
+    for (size_t i = 0; i < fn.code.size(); i++) {
+        Node *stmt = fn.code[i];
+        if (i + 1 < fn.code.size() && is_stmt(stmt))
+            return -1;
+        // 自分自身を呼ぶ関数は展開しない
+        if (calls(stmt, fn.name))
+            return -1;
+        cost += count_nodes(stmt);
+    }
+    return cost <= inline_threshold ? cost : -1;
+}
+
+// 式をコピーし、変数のオフセットをbaseだけずらす
+static Node *clone(Node *node, int base) {
+    if (!node)
+        return nullptr;
+    Node *copy = alloc_node(*arena, node->kind);
+    *copy = *node;
+    if (node->kind == NodeKind::ND_LVAR)
+        copy->offset += base;
+    copy->lhs = clone(node->lhs, base);
+    copy->rhs = clone(node->rhs, base);
+    if (node->kind == NodeKind::ND_FUNCALL) {
+        std::vector<Node *> args;
+        for (auto arg : *(node->args))
+            args.push_back(clone(arg, base));
+        copy->args = alloc_node_vec(*arena, args);
+    }
+    return copy;
+}
+
+static Node *new_comma(Node *lhs, Node *rhs) {
+    Node *node = alloc_node(*arena, NodeKind::ND_COMMA);
+    node->lhs = lhs;
+    node->rhs = rhs;
+    return node;
+}
+
+static Function *caller;
+static std::vector<std::string_view> expanding; // 展開中の関数 (相互再帰を止めるため)
+
+static Node *inline_expr(Node *node);
+
+// 引数を仮引数の新しい場所に代入してから、本体の式文とreturnの式を順に評価する
+static Node *expand(Node *call, const Function &callee) {
+    int base = caller->stack_size;
+    caller->stack_size += callee.stack_size;
+
+    std::vector<Node *> seq;
+    for (size_t i = 0; i < callee.params.size(); i++) {
+        Node *assign = alloc_node(*arena, NodeKind::ND_ASSIGN);
+        assign->lhs = clone(callee.params[i], base);
+        assign->rhs = (*call->args)[i];
+        seq.push_back(assign);
+    }
+    for (auto stmt : callee.code) {
+        Node *expr = stmt->kind == NodeKind::ND_RETURN ? stmt->lhs : stmt;
+        seq.push_back(clone(expr, base));
+    }
+
+    // 展開した本体の中の呼び出しも展開する
+    expanding.push_back(callee.name);
+    for (auto &expr : seq)
+        expr = inline_expr(expr);
+    expanding.pop_back();
+
+    Node *node = seq.back();
+    for (int i = int(seq.size()) - 2; i >= 0; i--)
+        node = new_comma(seq[i], node);
+    return node;
+}
+
+static Node *inline_expr(Node *node) {
+    if (!node)
+        return nullptr;
+    node->lhs = inline_expr(node->lhs);
+    node->rhs = inline_expr(node->rhs);
+    if (node->kind != NodeKind::ND_FUNCALL)
+        return node;
+
+    for (auto &arg : *(node->args))
+        arg = inline_expr(arg);
+
+    auto it = funcs.find(node->funcname);
+    if (it == funcs.end())
+        return node;
+    const Function &callee = *it->second;
+    if (callee.params.size() != node->args->size() || callee.name == caller->name ||
+        std::find(expanding.begin(), expanding.end(), callee.name) != expanding.end())
+        return node;
+    int cost = inline_cost(callee);
+    if (cost < 0)
+        return node;
+
+    if (opts.report)
+        fprintf(stderr, "inline: %s: %s (%d nodes)\n", caller->name.c_str(), callee.name.c_str(), cost);
+    return expand(node, callee);
+}
+
+static Node *inline_stmt(Node *node) {
+    if (!node)
+        return nullptr;
+    switch (node->kind) {
+    case NodeKind::ND_RETURN:
+        node->lhs = inline_expr(node->lhs);
+        return node;
+    case NodeKind::ND_IF:
+        node->cond = inline_expr(node->cond);
+        node->then = inline_stmt(node->then);
+        node->els = inline_stmt(node->els);
+        return node;
+    case NodeKind::ND_WHILE:
+        node->cond = inline_expr(node->cond);
+        node->then = inline_stmt(node->then);
+        return node;
+    case NodeKind::ND_FOR:
+        node->init = inline_expr(node->init);
+        node->cond = inline_expr(node->cond);
+        node->inc = inline_expr(node->inc);
+        node->then = inline_stmt(node->then);
+        return node;
+    case NodeKind::ND_BLOCK:
+        for (auto &stmt : *(node->body))
+            stmt = inline_stmt(stmt);
+        return node;
+    default:
+        return inline_expr(node);
+    }
+}
+
+void inline_functions(std::vector<Function> &prog, Arena &a) {
+    arena = &a;
+    funcs.clear();
+    for (auto &fn : prog)
+        funcs[fn.name] = &fn;
+
+    // 先に処理した関数は、展開した後の本体がそのまま他の関数に展開される
+    // 変数のオフセットもstack_sizeも展開後のものなので、コピーしてずらせばよい
+    for (auto &fn : prog) {
+        caller = &fn;
+        for (auto &stmt : fn.code)
+            stmt = inline_stmt(stmt);
+    }
+}
@@ -0,0 +1,370 @@
+#include "9cc.h"
+
+#include <mutex>
+#include <unistd.h>
+
+// 抽象構文木を仮想レジスタを使う中間表現に変換する
+// 関数ごとに別のスレッドで変換できるよう、状態はスレッドごとに持つ
+
+static thread_local IRFunc *fn;
+static thread_local BasicBlock *out;
+
+// ローカル変数 (オフセット, 仮想レジスタ)
+static thread_local std::map<int, int> vars;
+static thread_local std::vector<bool> is_var;
+
+static int new_vreg() {
+    is_var.push_back(false);
+    return fn->nvregs++;
+}
+
+static int var_vreg(int offset) {
+    if (vars.count(offset) == 0) {
+        int v = new_vreg();
+        is_var[v] = true;
+        vars[offset] = v;
+    }
+    return vars.at(offset);
+}
+
+IRFunc::~IRFunc() {
+    for (auto bb : bbs)
+        delete bb;
+}
+
+static BasicBlock *new_bb() {
+    BasicBlock *bb = new BasicBlock();
+    bb->id = fn->bbs.size();
+    fn->bbs.push_back(bb);
+    return bb;
+}
+
+static IR &emit(IROp op) {
+    out->irs.push_back(IR{.op = op});
+    return out->irs.back();
+}
+
+static void jmp(BasicBlock *bb) { emit(IROp::IR_JMP).then = bb; }
+
+static void br(int cond, BasicBlock *then, BasicBlock *els) {
+    IR &ir = emit(IROp::IR_BR);
+    ir.a = cond;
+    ir.then = then;
+    ir.els = els;
+}
+
+static bool has_assign(Node *node) {
+    if (!node)
+        return false;
+    if (node->kind == NodeKind::ND_ASSIGN)
+        return true;
+    if (node->kind == NodeKind::ND_FUNCALL) {
+        for (auto arg : *(node->args))
+            if (has_assign(arg))
+                return true;
+        return false;
+    }
+    return has_assign(node->lhs) || has_assign(node->rhs);
+}
+
+// 変数の仮想レジスタをそのまま使うと、後で評価される式の中の代入で
+// 値が書き換わってしまうのでコピーしておく
+static int protect(int v, bool clobbered) {
+    if (!is_var[v] || !clobbered)
+        return v;
+    int r = new_vreg();
+    IR &ir = emit(IROp::IR_MOV);
+    ir.dst = r;
+    ir.a = v;
+    return r;
+}
+
+static int gen_expr(Node *node);
+static void gen_stmt(Node *node);
+
+static int gen_binop(IROp op, Node *node) {
+    int a = protect(gen_expr(node->lhs), has_assign(node->rhs));
+    int b = gen_expr(node->rhs);
+    int r = new_vreg();
+    IR &ir = emit(op);
+    ir.dst = r;
+    ir.a = a;
+    ir.b = b;
+    return r;
+}
+
+static int gen_expr(Node *node) {
+    switch (node->kind) {
+    case NodeKind::ND_NUM: {
+        int r = new_vreg();
+        IR &ir = emit(IROp::IR_IMM);
+        ir.dst = r;
+        ir.imm = node->val;
+        return r;
+    }
+    case NodeKind::ND_LVAR:
+        return var_vreg(node->offset);
+    case NodeKind::ND_ASSIGN: {
+        if (node->lhs->kind != NodeKind::ND_LVAR)
+            error("代入の左辺値が変数ではありません");
+        int v = var_vreg(node->lhs->offset);
+        int r = gen_expr(node->rhs);
+        IR &ir = emit(IROp::IR_MOV);
+        ir.dst = v;
+        ir.a = r;
+        return v;
+    }
+    case NodeKind::ND_FUNCALL: {
+        NodeVec &args = *(node->args);
+        std::vector<int> vals;
+        for (size_t i = 0; i < args.size(); i++) {
+            bool clobbered = false;
+            for (size_t j = i + 1; j < args.size(); j++)
+                clobbered = clobbered || has_assign(args[j]);
+            vals.push_back(protect(gen_expr(args[i]), clobbered));
+        }
+        int r = new_vreg();
+        IR &ir = emit(IROp::IR_CALL);
+        ir.dst = r;
+        ir.name = node->funcname;
+        ir.args = vals;
+        return r;
+    }
+    case NodeKind::ND_ADD:
+        return gen_binop(IROp::IR_ADD, node);
+    case NodeKind::ND_SUB:
+        return gen_binop(IROp::IR_SUB, node);
+    case NodeKind::ND_MUL:
+        return gen_binop(IROp::IR_MUL, node);
+    case NodeKind::ND_DIV:
+        return gen_binop(IROp::IR_DIV, node);
+    case NodeKind::ND_EQ:
+        return gen_binop(IROp::IR_EQ, node);
+    case NodeKind::ND_NE:
+        return gen_binop(IROp::IR_NE, node);
+    case NodeKind::ND_LT:
+        return gen_binop(IROp::IR_LT, node);
+    case NodeKind::ND_LE:
+        return gen_binop(IROp::IR_LE, node);
+    case NodeKind::ND_COMMA:
+        gen_expr(node->lhs);
+        return gen_expr(node->rhs);
+    default:
+        error("式ではありません");
+        return -1;
+    }
+}
+
+static void gen_stmt(Node *node) {
+    if (!node)
+        return;
+    switch (node->kind) {
+    case NodeKind::ND_RETURN: {
+        int r = gen_expr(node->lhs);
+        emit(IROp::IR_RET).a = r;
+        // return以降の文は到達しないブロックに出力する
+        out = new_bb();
+        return;
+    }
+    case NodeKind::ND_IF: {
+        BasicBlock *then = new_bb();
+        BasicBlock *els = new_bb();
+        BasicBlock *end = node->els ? new_bb() : els;
+
+        br(gen_expr(node->cond), then, els);
+        out = then;
+        gen_stmt(node->then);
+        jmp(end);
+        if (node->els) {
+            out = els;
+            gen_stmt(node->els);
+            jmp(end);
+        }
+        out = end;
+        return;
+    }
+    case NodeKind::ND_WHILE:
+    case NodeKind::ND_FOR: {
+        if (node->init)
+            gen_expr(node->init);
+        if (opts.loop_rotate && node->cond) {
+            // 条件のブロックは本体のブロックの後ろに置く
+            // 最初に条件へ飛ぶジャンプの行き先は、条件のブロックを作ってから決める
+            BasicBlock *entry = out;
+            BasicBlock *body = new_bb();
+            jmp(nullptr);
+            out = body;
+            gen_stmt(node->then);
+            if (node->inc)
+                gen_expr(node->inc);
+            BasicBlock *cond = new_bb();
+            BasicBlock *end = new_bb();
+            entry->irs.back().then = cond;
+            jmp(cond);
+            out = cond;
+            br(gen_expr(node->cond), body, end);
+            out = end;
+            return;
+        }
+
+        BasicBlock *begin = new_bb();
+        BasicBlock *body = new_bb();
+        BasicBlock *end = new_bb();
+
+        jmp(begin);
+        out = begin;
+        if (node->cond)
+            br(gen_expr(node->cond), body, end);
+        else
+            jmp(body);
+        out = body;
+        gen_stmt(node->then);
+        if (node->inc)
+            gen_expr(node->inc);
+        jmp(begin);
+        out = end;
+        return;
+    }
+    case NodeKind::ND_BLOCK:
+        for (auto stmt : *(node->body))
+            gen_stmt(stmt);
+        return;
+    default:
+        gen_expr(node);
+        return;
+    }
+}
+
+IRFunc gen_ir(const Function &func) {
+    IRFunc irf;
+    irf.name = func.name;
+    fn = &irf;
+    vars.clear();
+    is_var.clear();
+
+    out = new_bb();
+    for (auto param : func.params)
+        irf.params.push_back(var_vreg(param->offset));
+
+    for (auto node : func.code)
+        gen_stmt(node);
+
+    // returnせずに関数の終わりに到達した場合は0を返す
+    int r = new_vreg();
+    IR &ir = emit(IROp::IR_IMM);
+    ir.dst = r;
+    ir.imm = 0;
+    emit(IROp::IR_RET).a = r;
+
+    update_cfg(irf);
+    return irf;
+}
+
+void update_cfg(IRFunc &fn) {
+    for (auto bb : fn.bbs) {
+        IR &last = bb->irs.back();
+        bb->succ.clear();
+        bb->pred.clear();
+        // 両方の行き先が同じ分岐はただのジャンプにする
+        if (last.op == IROp::IR_BR && last.then == last.els)
+            last = IR{.op = IROp::IR_JMP, .then = last.then};
+        if (last.op == IROp::IR_JMP)
+            bb->succ = {last.then};
+        else if (last.op == IROp::IR_BR)
+            bb->succ = {last.then, last.els};
+    }
+
+    // 入口から辿れるブロックだけを元の順に残す
+    std::vector<bool> reachable(fn.bbs.size());
+    std::vector<BasicBlock *> stack = {fn.bbs[0]};
+    reachable[0] = true;
+    while (!stack.empty()) {
+        BasicBlock *bb = stack.back();
+        stack.pop_back();
+        for (auto succ : bb->succ) {
+            if (!reachable[succ->id]) {
+                reachable[succ->id] = true;
+                stack.push_back(succ);
+            }
+        }
+    }
+
+    std::vector<BasicBlock *> bbs;
+    for (auto bb : fn.bbs) {
+        if (reachable[bb->id])
+            bbs.push_back(bb);
+        else
+            delete bb;
+    }
+    fn.bbs = bbs;
+    for (size_t i = 0; i < bbs.size(); i++)
+        bbs[i]->id = i;
+    for (auto bb : bbs)
+        for (auto succ : bb->succ)
+            succ->pred.push_back(bb);
+
+    // なくなった辺から来るphiの値を取り除く
+    for (auto bb : bbs) {
+        for (auto &ir : bb->irs) {
+            if (ir.op != IROp::IR_PHI)
+                continue;
+            for (size_t i = 0; i < ir.from.size();) {
+                if (std::find(bb->pred.begin(), bb->pred.end(), ir.from[i]) == bb->pred.end()) {
+                    ir.from.erase(ir.from.begin() + i);
+                    ir.args.erase(ir.args.begin() + i);
+                } else {
+                    i++;
+                }
+            }
+        }
+    }
+}
+
+static const char *op_names[] = {"imm", "mov", "add", "sub", "mul", "div", "eq", "ne",
+                                 "lt",  "le",  "call", "phi", "ret", "jmp", "br"};
+
+void dump_ir(const IRFunc &fn, std::string_view title) {
+    Emitter out;
+    out << "== " << fn.name << ": " << title << " ==\n";
+    for (auto bb : fn.bbs) {
+        out << "bb" << bb->id << ":\n";
+        for (auto &ir : bb->irs) {
+            out << "  ";
+            if (ir.dst >= 0)
+                out << 'v' << ir.dst << " = ";
+            out << op_names[int(ir.op)];
+            switch (ir.op) {
+            case IROp::IR_IMM:
+                out << ' ' << ir.imm;
+                break;
+            case IROp::IR_CALL:
+                out << ' ' << ir.name;
+                for (int arg : ir.args)
+                    out << " v" << arg;
+                break;
+            case IROp::IR_PHI:
+                for (size_t i = 0; i < ir.args.size(); i++)
+                    out << " [bb" << ir.from[i]->id << ": v" << ir.args[i] << ']';
+                break;
+            case IROp::IR_JMP:
+                out << " bb" << ir.then->id;
+                break;
+            case IROp::IR_BR:
+                out << " v" << ir.a << ", bb" << ir.then->id << ", bb" << ir.els->id;
+                break;
+            default:
+                if (ir.a >= 0)
+                    out << " v" << ir.a;
+                if (ir.b >= 0)
+                    out << ", v" << ir.b;
+                break;
+            }
+            out << '\n';
+        }
+    }
+
+    // 複数のスレッドから呼ばれても関数ごとにまとまって表示されるようにする
+    static std::mutex mu;
+    std::lock_guard<std::mutex> lock(mu);
+    out.write_to(STDERR_FILENO);
+}
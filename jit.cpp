@@ -0,0 +1,63 @@
+#include "9cc.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// 機械語をメモリに置いて、そのまま実行する
+
+// ホストの関数はrel32で届かない位置にあるかもしれないので、
+// コードの後ろに置いたスタブから64bitの絶対アドレスにジャンプする
+static void add_stub(Emitter &text, void *addr) {
+    // movabs r11, addr
+    text.bytes<uint8_t>(0x49);
+    text.bytes<uint8_t>(0xbb);
+    text.bytes<uint64_t>(uint64_t(addr));
+    // jmp r11
+    text.bytes<uint8_t>(0x41);
+    text.bytes<uint8_t>(0xff);
+    text.bytes<uint8_t>(0xe3);
+}
+
+JitCode::JitCode(const std::vector<AsmFunc> &funcs) {
+    MachineCode mc = assemble(funcs);
+
+    std::map<std::string_view, size_t> stubs;
+    for (auto &r : mc.relocs) {
+        if (stubs.count(r.sym) == 0) {
+            auto it = host_funcs.find(r.sym);
+            if (it == host_funcs.end())
+                error("未定義の関数です: %.*s", int(r.sym.size()), r.sym.data());
+            mc.text.align(16);
+            stubs[r.sym] = mc.text.size();
+            add_stub(mc.text, it->second.addr);
+        }
+        mc.text.patch<int32_t>(r.offset, stubs[r.sym] - (r.offset + 4));
+    }
+    for (auto &f : mc.funcs)
+        syms[std::string(f.name)] = f.offset;
+
+    // 書き込みと実行を同時には許さない
+    // 書き込み可能な状態でコードを置いてから、読み込みと実行だけに切り替える
+    size_t page = sysconf(_SC_PAGESIZE);
+    size = std::max<size_t>((mc.text.size() + page - 1) / page * page, page);
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        error("コード用のメモリを確保できません");
+    mem = static_cast<char *>(p);
+    mc.text.copy_to(mem, size);
+    if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0)
+        error("コードを実行可能にできません");
+}
+
+JitCode::~JitCode() {
+    if (mem)
+        munmap(mem, size);
+}
+
+long JitCode::call(std::string_view name) const {
+    auto it = syms.find(name);
+    if (it == syms.end())
+        error("関数がありません: %.*s", int(name.size()), name.data());
+    auto fn = reinterpret_cast<long (*)()>(mem + it->second);
+    return fn();
+}
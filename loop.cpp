@@ -0,0 +1,399 @@
+#include "9cc.h"
+
+#include <set>
+
+// ループの最適化
+// 内側のループから順に、次の変換を有効になっているものだけ行う
+// - 展開: for (i = A; i < B; i = i + C) の回数が定数なら、本体を並べるか、数周分ずつまとめる
+// - ループ不変式の移動: ループの中で値の変わらない式をループの前で1回だけ計算する
+// - 帰納変数の強さの軽減: i = i + C で増える変数の i * K を、C * K ずつ増える変数に置き換える
+// 前で計算する式はループの初期化の後に置く
+
+// 展開した後の本体のノード数の上限
+static const int unroll_threshold = 64;
+// 部分的に展開するときにまとめる周回の数
+static const int unroll_factor = 4;
+
+static Arena *arena;
+static Function *fn;
+static int unrolled;
+static int hoisted;
+static int reduced;
+
+static Node *new_num(long val) {
+    Node *node = alloc_node(*arena, NodeKind::ND_NUM);
+    node->val = val;
+    return node;
+}
+
+static Node *new_lvar(int offset) {
+    Node *node = alloc_node(*arena, NodeKind::ND_LVAR);
+    node->offset = offset;
+    return node;
+}
+
+static Node *new_binary(NodeKind kind, Node *lhs, Node *rhs) {
+    Node *node = alloc_node(*arena, kind);
+    node->lhs = lhs;
+    node->rhs = rhs;
+    return node;
+}
+
+static Node *new_assign(int offset, Node *rhs) { return new_binary(NodeKind::ND_ASSIGN, new_lvar(offset), rhs); }
+
+static Node *new_block(const std::vector<Node *> &stmts) {
+    Node *node = alloc_node(*arena, NodeKind::ND_BLOCK);
+    node->body = alloc_node_vec(*arena, stmts);
+    return node;
+}
+
+static int new_temp() {
+    fn->stack_size += 8;
+    return fn->stack_size;
+}
+
+static bool fits_int(long v) { return INT32_MIN <= v && v <= INT32_MAX; }
+
+// 子になりうるノードをすべて辿る
+template <typename F> static void for_each_child(Node *node, F f) {
+    for (Node *child : {node->lhs, node->rhs, node->cond, node->then, node->els, node->init, node->inc})
+        if (child)
+            f(child);
+    if (node->kind == NodeKind::ND_BLOCK)
+        for (auto stmt : *(node->body))
+            f(stmt);
+    if (node->kind == NodeKind::ND_FUNCALL)
+        for (auto arg : *(node->args))
+            f(arg);
+}
+
+// 変数ごとに代入の回数を数える
+static void count_assigns(Node *node, std::map<int, int> &count) {
+    if (!node)
+        return;
+    if (node->kind == NodeKind::ND_ASSIGN)
+        count[node->lhs->offset]++;
+    for_each_child(node, [&](Node *child) { count_assigns(child, count); });
+}
+
+static std::map<int, int> loop_assigns(Node *loop) {
+    std::map<int, int> count;
+    count_assigns(loop->cond, count);
+    count_assigns(loop->then, count);
+    count_assigns(loop->inc, count);
+    return count;
+}
+
+static int count_nodes(Node *node) {
+    int n = 1;
+    for_each_child(node, [&](Node *child) { n += count_nodes(child); });
+    return n;
+}
+
+// 文や式をコピーする。varの変数を読むところはvalueのコピーにする
+static Node *clone(Node *node, int var = 0, Node *value = nullptr) {
+    if (!node)
+        return nullptr;
+    if (value && node->kind == NodeKind::ND_LVAR && node->offset == var)
+        return clone(value);
+    Node *copy = alloc_node(*arena, node->kind);
+    *copy = *node;
+    copy->lhs = clone(node->lhs, var, value);
+    copy->rhs = clone(node->rhs, var, value);
+    copy->cond = clone(node->cond, var, value);
+    copy->then = clone(node->then, var, value);
+    copy->els = clone(node->els, var, value);
+    copy->init = clone(node->init, var, value);
+    copy->inc = clone(node->inc, var, value);
+    std::vector<Node *> nodes;
+    if (node->kind == NodeKind::ND_BLOCK) {
+        for (auto stmt : *(node->body))
+            nodes.push_back(clone(stmt, var, value));
+        copy->body = alloc_node_vec(*arena, nodes);
+    }
+    if (node->kind == NodeKind::ND_FUNCALL) {
+        for (auto arg : *(node->args))
+            nodes.push_back(clone(arg, var, value));
+        copy->args = alloc_node_vec(*arena, nodes);
+    }
+    return copy;
+}
+
+// ループのノードをその場でブロック { 初期化; pre...; ループ } に置き換え、新しいループのノードを返す
+static Node *wrap(Node *loop, const std::vector<Node *> &pre) {
+    Node *copy = alloc_node(*arena, loop->kind);
+    *copy = *loop;
+    copy->init = nullptr;
+
+    std::vector<Node *> stmts;
+    if (loop->init)
+        stmts.push_back(loop->init);
+    stmts.insert(stmts.end(), pre.begin(), pre.end());
+    stmts.push_back(copy);
+
+    NodeKind kind = NodeKind::ND_BLOCK;
+    *loop = Node{};
+    loop->kind = kind;
+    loop->body = alloc_node_vec(*arena, stmts);
+    return copy;
+}
+
+// var = var + C の形ならCを返す
+static std::optional<long> step_of(Node *node, int var) {
+    if (!node || node->kind != NodeKind::ND_ASSIGN || node->lhs->offset != var)
+        return std::nullopt;
+    Node *rhs = node->rhs;
+    auto is_var = [&](Node *n) { return n->kind == NodeKind::ND_LVAR && n->offset == var; };
+    if (rhs->kind == NodeKind::ND_ADD && is_var(rhs->lhs) && rhs->rhs->kind == NodeKind::ND_NUM)
+        return rhs->rhs->val;
+    if (rhs->kind == NodeKind::ND_ADD && is_var(rhs->rhs) && rhs->lhs->kind == NodeKind::ND_NUM)
+        return rhs->lhs->val;
+    if (rhs->kind == NodeKind::ND_SUB && is_var(rhs->lhs) && rhs->rhs->kind == NodeKind::ND_NUM)
+        return -long(rhs->rhs->val);
+    return std::nullopt;
+}
+
+// for (i = A; i < B (または i <= B); i = i + C) で、本体がiに代入しないループを展開する
+// 回数が少なければ本体を iを定数にして並べ、多ければunroll_factor周分ずつまとめる
+// 展開したループのノードを返す。全部並べてループがなくなったらnullptrを返す
+static Node *unroll(Node *loop) {
+    if (loop->kind != NodeKind::ND_FOR || !loop->init || !loop->cond || !loop->inc)
+        return loop;
+    Node *init = loop->init;
+    Node *cond = loop->cond;
+    if (init->kind != NodeKind::ND_ASSIGN || init->rhs->kind != NodeKind::ND_NUM)
+        return loop;
+    int var = init->lhs->offset;
+    if ((cond->kind != NodeKind::ND_LT && cond->kind != NodeKind::ND_LE) ||
+        cond->lhs->kind != NodeKind::ND_LVAR || cond->lhs->offset != var || cond->rhs->kind != NodeKind::ND_NUM)
+        return loop;
+    auto step = step_of(loop->inc, var);
+    if (!step || *step <= 0)
+        return loop;
+    std::map<int, int> assigns;
+    count_assigns(loop->then, assigns);
+    count_assigns(cond, assigns);
+    if (assigns.count(var))
+        return loop;
+
+    long start = init->rhs->val;
+    long bound = cond->rhs->val;
+    long span = bound - start + (cond->kind == NodeKind::ND_LE ? 1 : 0);
+    long n = span <= 0 ? 0 : (span + *step - 1) / *step;
+    if (n == 0 || !fits_int(start + n * *step))
+        return loop;
+
+    auto iteration = [&](long k) { return clone(loop->then, var, new_num(start + k * *step)); };
+    int size = count_nodes(loop->then);
+
+    // 全部並べて、最後にiをループを抜けたときの値にする
+    if (n * size <= unroll_threshold) {
+        std::vector<Node *> stmts;
+        for (long k = 0; k < n; k++)
+            stmts.push_back(iteration(k));
+        stmts.push_back(new_assign(var, new_num(start + n * *step)));
+        *loop = *new_block(stmts);
+        unrolled++;
+        return nullptr;
+    }
+
+    // 余りの周回を先に並べ、残りはunroll_factor周分をまとめたループにする
+    if (n < 2 * unroll_factor || size * unroll_factor > unroll_threshold || !fits_int(*step * unroll_factor))
+        return loop;
+    long rest = n % unroll_factor;
+    std::vector<Node *> stmts;
+    for (long k = 0; k < rest; k++)
+        stmts.push_back(iteration(k));
+
+    std::vector<Node *> body;
+    for (long k = 0; k < unroll_factor; k++) {
+        Node *i = new_binary(NodeKind::ND_ADD, new_lvar(var), new_num(k * *step));
+        body.push_back(k == 0 ? loop->then : clone(loop->then, var, i));
+    }
+    Node *copy = alloc_node(*arena, NodeKind::ND_FOR);
+    copy->init = new_assign(var, new_num(start + rest * *step));
+    copy->cond = cond;
+    copy->inc = new_assign(var, new_binary(NodeKind::ND_ADD, new_lvar(var), new_num(*step * unroll_factor)));
+    copy->then = new_block(body);
+    stmts.push_back(copy);
+    *loop = *new_block(stmts);
+    unrolled++;
+    return copy;
+}
+
+// ループの中で値が変わらず、前に出して計算しても問題ない式か
+// 割り算は0で割るかもしれないので、割る数が0でも-1でもない定数のときだけ出す
+static bool is_invariant(Node *node, const std::map<int, int> &assigns) {
+    switch (node->kind) {
+    case NodeKind::ND_NUM:
+        return true;
+    case NodeKind::ND_LVAR:
+        return assigns.count(node->offset) == 0;
+    case NodeKind::ND_ADD:
+    case NodeKind::ND_SUB:
+    case NodeKind::ND_MUL:
+    case NodeKind::ND_EQ:
+    case NodeKind::ND_NE:
+    case NodeKind::ND_LT:
+    case NodeKind::ND_LE:
+        return is_invariant(node->lhs, assigns) && is_invariant(node->rhs, assigns);
+    case NodeKind::ND_DIV:
+        return node->rhs->kind == NodeKind::ND_NUM && node->rhs->val != 0 && node->rhs->val != -1 &&
+               is_invariant(node->lhs, assigns);
+    default:
+        return false;
+    }
+}
+
+// 不変な式のうち、演算を含む一番外側のものを集める
+static void find_invariants(Node *node, const std::map<int, int> &assigns, std::vector<Node *> &found) {
+    if (!node)
+        return;
+    if (node->kind != NodeKind::ND_NUM && node->kind != NodeKind::ND_LVAR && is_invariant(node, assigns)) {
+        found.push_back(node);
+        return;
+    }
+    // 代入の左辺は読まないので見ない
+    if (node->kind == NodeKind::ND_ASSIGN) {
+        find_invariants(node->rhs, assigns, found);
+        return;
+    }
+    for_each_child(node, [&](Node *child) { find_invariants(child, assigns, found); });
+}
+
+static Node *hoist_invariants(Node *loop) {
+    std::map<int, int> assigns = loop_assigns(loop);
+    std::vector<Node *> found;
+    find_invariants(loop->cond, assigns, found);
+    find_invariants(loop->then, assigns, found);
+    find_invariants(loop->inc, assigns, found);
+    if (found.empty())
+        return loop;
+
+    std::vector<Node *> pre;
+    for (auto node : found) {
+        int t = new_temp();
+        pre.push_back(new_assign(t, clone(node)));
+        *node = *new_lvar(t);
+    }
+    hoisted += found.size();
+    return wrap(loop, pre);
+}
+
+// var * K の形ならKを返す
+static std::optional<long> scale_of(Node *node, int var) {
+    if (node->kind != NodeKind::ND_MUL)
+        return std::nullopt;
+    auto is_var = [&](Node *n) { return n->kind == NodeKind::ND_LVAR && n->offset == var; };
+    if (is_var(node->lhs) && node->rhs->kind == NodeKind::ND_NUM)
+        return node->rhs->val;
+    if (is_var(node->rhs) && node->lhs->kind == NodeKind::ND_NUM)
+        return node->lhs->val;
+    return std::nullopt;
+}
+
+static void find_products(Node *node, int var, std::vector<Node *> &found) {
+    if (!node)
+        return;
+    if (scale_of(node, var)) {
+        found.push_back(node);
+        return;
+    }
+    for_each_child(node, [&](Node *child) { find_products(child, var, found); });
+}
+
+// ループの中でi = i + Cの1回だけ代入される変数iについて、i * Kを
+// ループの前でi * Kに初期化し、iと一緒にC * Kずつ増やす変数に置き換える
+// iの更新はincか、本体のブロックの直下の文でなければならない (毎周1回だけ実行される)
+static Node *reduce_strength(Node *loop) {
+    std::vector<Node *> stmts;
+    if (loop->then->kind == NodeKind::ND_BLOCK)
+        stmts.assign(loop->then->body->begin(), loop->then->body->end());
+    else
+        stmts.push_back(loop->then);
+
+    std::vector<Node *> pre;
+    for (auto [var, count] : loop_assigns(loop)) {
+        if (count != 1)
+            continue;
+        // iを更新する場所
+        Node **update = nullptr;
+        if (step_of(loop->inc, var))
+            update = &loop->inc;
+        for (auto &stmt : stmts)
+            if (step_of(stmt, var))
+                update = &stmt;
+        if (!update)
+            continue;
+        long step = *step_of(*update, var);
+
+        std::vector<Node *> found;
+        find_products(loop->cond, var, found);
+        find_products(loop->then, var, found);
+        find_products(loop->inc, var, found);
+
+        std::map<long, int> temps; // K => 置き換える変数
+        for (auto node : found) {
+            long scale = *scale_of(node, var);
+            if (!fits_int(step * scale))
+                continue;
+            if (temps.count(scale) == 0) {
+                int t = new_temp();
+                temps[scale] = t;
+                pre.push_back(new_assign(t, new_binary(NodeKind::ND_MUL, new_lvar(var), new_num(scale))));
+                Node *inc = new_assign(t, new_binary(NodeKind::ND_ADD, new_lvar(t), new_num(step * scale)));
+                *update = new_binary(NodeKind::ND_COMMA, *update, inc);
+                reduced++;
+            }
+            *node = *new_lvar(temps[scale]);
+        }
+    }
+    if (pre.empty())
+        return loop;
+
+    if (loop->then->kind == NodeKind::ND_BLOCK)
+        loop->then->body = alloc_node_vec(*arena, stmts);
+    else
+        loop->then = stmts[0];
+    return wrap(loop, pre);
+}
+
+static void optimize_stmt(Node *node) {
+    if (!node)
+        return;
+    switch (node->kind) {
+    case NodeKind::ND_IF:
+        optimize_stmt(node->then);
+        optimize_stmt(node->els);
+        return;
+    case NodeKind::ND_BLOCK:
+        for (auto stmt : *(node->body))
+            optimize_stmt(stmt);
+        return;
+    case NodeKind::ND_WHILE:
+    case NodeKind::ND_FOR:
+        break;
+    default:
+        return;
+    }
+
+    optimize_stmt(node->then);
+    Node *loop = node;
+    if (opts.unroll_loops && !(loop = unroll(loop)))
+        return;
+    if (opts.loop_invariant)
+        loop = hoist_invariants(loop);
+    if (opts.strength_reduce)
+        reduce_strength(loop);
+}
+
+void optimize_loops(Function &f, Arena &a) {
+    arena = &a;
+    fn = &f;
+    unrolled = hoisted = reduced = 0;
+    for (auto stmt : fn->code)
+        optimize_stmt(stmt);
+    if (opts.report)
+        fprintf(stderr, "loop: %s: %d unrolled, %d invariants hoisted, %d induction variables reduced\n",
+                fn->name.c_str(), unrolled, hoisted, reduced);
+}
@@ -1,21 +1,188 @@
 #include "9cc.h"
 
+#include <fcntl.h>
+#include <chrono>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+Options opts;
+
+struct Flag {
+    bool Options::*member;
+    bool optimization; // -Oで有効になるか
+};
+
+// -fXXX / -fno-XXX で切り替えられるオプション
+static const std::map<std::string, Flag> flags = {
+    {"regalloc", {&Options::regalloc, false}},
+    {"fold", {&Options::fold, true}},
+    {"report", {&Options::report, false}},
+    {"jit", {&Options::jit, false}},
+    {"vm", {&Options::vm, false}},
+    {"sccp", {&Options::sccp, true}},
+    {"copyprop", {&Options::copyprop, true}},
+    {"dce", {&Options::dce, true}},
+    {"peephole", {&Options::peephole, true}},
+    {"tail-call", {&Options::tailcall, true}},
+    {"inline", {&Options::inlining, true}},
+    {"omit-frame-pointer", {&Options::omit_frame, true}},
+    {"share-slots", {&Options::share_slots, true}},
+    {"const-eval", {&Options::const_eval, true}},
+    {"cse", {&Options::cse, true}},
+    {"loop-rotate", {&Options::loop_rotate, true}},
+    {"loop-invariant", {&Options::loop_invariant, true}},
+    {"strength-reduce", {&Options::strength_reduce, true}},
+    {"unroll-loops", {&Options::unroll_loops, true}},
+    {"dead-code", {&Options::dead_code, true}},
+    {"dump-ir", {&Options::dump_ir, false}},
+};
+
+static bool parse_option(const std::string &arg) {
+    if (arg == "-c") {
+        opts.object = true;
+        return true;
+    }
+
+    // -jN でN個のスレッドでコードを生成する。-j だけならCPUの数にする
+    if (arg.substr(0, 2) == "-j") {
+        std::string n = arg.substr(2);
+        opts.jobs = n.empty() ? std::max(1u, std::thread::hardware_concurrency()) : atoi(n.c_str());
+        if (opts.jobs < 1)
+            error("スレッド数が正しくありません: %s", arg.c_str());
+        return true;
+    }
+
+    // -O, -O1 で最適化をすべて有効に、-O0 ですべて無効にする
+    if (arg == "-O" || arg == "-O1" || arg == "-O0") {
+        for (auto &[name, flag] : flags)
+            if (flag.optimization)
+                opts.*flag.member = arg != "-O0";
+        return true;
+    }
+
+    if (arg.substr(0, 2) != "-f")
+        return false;
+    std::string name = arg.substr(2);
+    bool val = true;
+    if (name.substr(0, 3) == "no-") {
+        name = name.substr(3);
+        val = false;
+    }
+    if (flags.count(name) == 0)
+        error("不明なオプションです: %s", arg.c_str());
+    opts.*flags.at(name).member = val;
+    return true;
+}
+
+// 引数が"-"なら標準入力、ファイルがあればそのファイル、
+// どちらでもなければ引数そのものをプログラムとして読む
+static Source read_source(const std::string &arg) {
+    struct stat st;
+    if (arg == "-" || stat(arg.c_str(), &st) == 0)
+        return Source::from_file(arg);
+    return Source::from_string(arg);
+}
+
+static void write_output(const Emitter &out) {
+    if (opts.output.empty()) {
+        out.write_to(STDOUT_FILENO);
+        return;
+    }
+    int fd = open(opts.output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        error("ファイルを開けません: %s", opts.output.c_str());
+    out.write_to(fd);
+    close(fd);
+}
+
+// 経過時間をミリ秒にする
+static double ms(std::chrono::steady_clock::duration d) {
+    return std::chrono::duration<double, std::milli>(d).count();
+}
+
+static void report_arena(const Arena &arena) {
+    fprintf(stderr, "arena: peak %zu bytes used, %zu bytes reserved\n", arena.peak(), arena.reserved());
+}
+
 int main(int argc, const char *argv[]) {
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; i++) {
+        if (std::string(argv[i]) == "-o") {
+            if (i + 1 == argc)
+                error("-oの後に出力先がありません");
+            opts.output = argv[++i];
+            continue;
+        }
+        if (!parse_option(argv[i]))
+            args.push_back(argv[i]);
+    }
+
     // デバッグ用にtokensを表示する
-    if (argc == 3 && std::string{argv[1]} == "p") {
-        std::list<Token> tokens = tokenize(argv[2]);
-        std::for_each(tokens.begin(), tokens.end(),
+    if (args.size() == 2 && args[0] == "p") {
+        Source src = read_source(args[1]);
+        TokenStream tokens = tokenize(src.text());
+        std::for_each(tokens.tokens.begin(), tokens.tokens.end(),
                       [](const Token &t) -> void { std::cout << t.to_string() << std::endl; });
         return 0;
     }
 
-    if (argc != 2) {
+    if (args.size() != 1) {
         error("引数の個数が正しくありません\n");
         return 1;
     }
 
-    std::list<Token> tokens = tokenize(argv[1]);
-    auto prog = program(tokens);
-    codegen(prog);
+    using clock = std::chrono::steady_clock;
+    auto start = clock::now();
+    Source src = read_source(args[0]);
+
+    // ノードはすべてarenaが持ち、コンパイルが終わったらまとめて解放する
+    Arena arena;
+    TokenStream tokens = tokenize(src.text());
+    auto prog = program(tokens, arena);
+    optimize(prog, arena);
+
+    // -fvmならバイトコードに変換してmainを実行し、その戻り値で終了する
+    if (opts.vm) {
+        VMProgram vm(prog);
+        auto compiled = clock::now();
+        int ret = vm.call("main");
+        auto finished = clock::now();
+        if (opts.report) {
+            fprintf(stderr, "vm: %zu instructions, compile %.3f ms, run %.3f ms\n", vm.size(), ms(compiled - start),
+                    ms(finished - compiled));
+            report_arena(arena);
+        }
+        return ret;
+    }
+
+    // 出力はバッファに溜めておき、最後にまとめて書き出す
+    auto funcs = codegen(prog);
+    if (opts.report && opts.peephole)
+        for (auto &fn : funcs)
+            fprintf(stderr, "peephole: %s: %d instructions removed\n", fn.name.c_str(), fn.peephole_removed);
+
+    // -fjitならmainを直接呼び出し、その戻り値で終了する
+    if (opts.jit) {
+        JitCode code(funcs);
+        auto compiled = clock::now();
+        int ret = code.call("main");
+        auto finished = clock::now();
+        if (opts.report) {
+            fprintf(stderr, "jit: compile %.3f ms, run %.3f ms\n", ms(compiled - start), ms(finished - compiled));
+            report_arena(arena);
+        }
+        return ret;
+    }
+
+    Emitter out;
+    if (opts.object)
+        emit_obj(funcs, out);
+    else
+        emit_asm(funcs, out);
+    write_output(out);
+
+    if (opts.report)
+        report_arena(arena);
     return 0;
 }
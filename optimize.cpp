@@ -0,0 +1,262 @@
+#include "9cc.h"
+
+// 抽象構文木に対する最適化
+
+// 新しいノードを確保するアリーナ
+static Arena *arena;
+
+// 評価しても副作用のない式か
+static bool is_pure(Node *node) {
+    if (!node)
+        return true;
+    if (node->kind == NodeKind::ND_ASSIGN || node->kind == NodeKind::ND_FUNCALL)
+        return false;
+    return is_pure(node->lhs) && is_pure(node->rhs);
+}
+
+// 同じ値になることが構文からわかる式か
+static bool same_expr(Node *a, Node *b) {
+    if (!a || !b)
+        return a == b;
+    if (a->kind != b->kind)
+        return false;
+    switch (a->kind) {
+    case NodeKind::ND_NUM:
+        return a->val == b->val;
+    case NodeKind::ND_LVAR:
+        return a->offset == b->offset;
+    case NodeKind::ND_ASSIGN:
+    case NodeKind::ND_FUNCALL:
+        return false;
+    default:
+        return same_expr(a->lhs, b->lhs) && same_expr(a->rhs, b->rhs);
+    }
+}
+
+static bool is_num(Node *node, int val) { return node->kind == NodeKind::ND_NUM && node->val == val; }
+
+static Node *to_num(Node *node, int val) {
+    node->kind = NodeKind::ND_NUM;
+    node->val = val;
+    node->lhs = nullptr;
+    node->rhs = nullptr;
+    return node;
+}
+
+// 両辺が定数の二項演算を計算する
+// 実行時は64bitで計算するので、結果がintに収まらない場合やゼロ除算は畳み込まない
+static bool eval_binop(NodeKind kind, long l, long r, int &val) {
+    long v;
+    switch (kind) {
+    case NodeKind::ND_ADD:
+        v = l + r;
+        break;
+    case NodeKind::ND_SUB:
+        v = l - r;
+        break;
+    case NodeKind::ND_MUL:
+        v = l * r;
+        break;
+    case NodeKind::ND_DIV:
+        if (r == 0)
+            return false;
+        v = l / r;
+        break;
+    case NodeKind::ND_EQ:
+        v = l == r;
+        break;
+    case NodeKind::ND_NE:
+        v = l != r;
+        break;
+    case NodeKind::ND_LT:
+        v = l < r;
+        break;
+    case NodeKind::ND_LE:
+        v = l <= r;
+        break;
+    default:
+        return false;
+    }
+    if (v < INT32_MIN || INT32_MAX < v)
+        return false;
+    val = v;
+    return true;
+}
+
+static Node *fold_expr(Node *node) {
+    if (!node)
+        return nullptr;
+
+    switch (node->kind) {
+    case NodeKind::ND_NUM:
+    case NodeKind::ND_LVAR:
+        return node;
+    case NodeKind::ND_ASSIGN:
+        node->rhs = fold_expr(node->rhs);
+        return node;
+    case NodeKind::ND_FUNCALL:
+        for (auto &arg : *(node->args))
+            arg = fold_expr(arg);
+        return node;
+    case NodeKind::ND_COMMA:
+        // 副作用のない左辺は評価しなくてよい
+        node->lhs = fold_expr(node->lhs);
+        node->rhs = fold_expr(node->rhs);
+        return is_pure(node->lhs) ? node->rhs : node;
+    default:
+        break;
+    }
+
+    Node *lhs = node->lhs = fold_expr(node->lhs);
+    Node *rhs = node->rhs = fold_expr(node->rhs);
+
+    int val;
+    if (lhs->kind == NodeKind::ND_NUM && rhs->kind == NodeKind::ND_NUM &&
+        eval_binop(node->kind, lhs->val, rhs->val, val))
+        return to_num(node, val);
+
+    switch (node->kind) {
+    case NodeKind::ND_ADD:
+        // x+0, 0+x => x
+        if (is_num(rhs, 0))
+            return lhs;
+        if (is_num(lhs, 0))
+            return rhs;
+        break;
+    case NodeKind::ND_SUB:
+        // x-0 => x
+        if (is_num(rhs, 0))
+            return lhs;
+        // x-x => 0
+        if (is_pure(lhs) && same_expr(lhs, rhs))
+            return to_num(node, 0);
+        // -(-x) => x (単項マイナスは0-xになっている)
+        if (is_num(lhs, 0) && rhs->kind == NodeKind::ND_SUB && is_num(rhs->lhs, 0))
+            return rhs->rhs;
+        break;
+    case NodeKind::ND_MUL:
+        // x*1, 1*x => x
+        if (is_num(rhs, 1))
+            return lhs;
+        if (is_num(lhs, 1))
+            return rhs;
+        // x*0, 0*x => 0
+        if ((is_num(rhs, 0) && is_pure(lhs)) || (is_num(lhs, 0) && is_pure(rhs)))
+            return to_num(node, 0);
+        break;
+    case NodeKind::ND_DIV:
+        // x/1 => x
+        if (is_num(rhs, 1))
+            return lhs;
+        break;
+    default:
+        break;
+    }
+    return node;
+}
+
+static Node *empty_block() {
+    Node *node = alloc_node(*arena, NodeKind::ND_BLOCK);
+    node->body = alloc_node_vec(*arena, {});
+    return node;
+}
+
+// 文を簡約する。文が丸ごと消える場合はnullptrを返す
+static Node *fold_stmt(Node *node) {
+    if (!node)
+        return nullptr;
+
+    switch (node->kind) {
+    case NodeKind::ND_RETURN:
+        node->lhs = fold_expr(node->lhs);
+        return node;
+    case NodeKind::ND_IF: {
+        node->cond = fold_expr(node->cond);
+        node->then = fold_stmt(node->then);
+        node->els = fold_stmt(node->els);
+        if (node->cond->kind == NodeKind::ND_NUM)
+            return node->cond->val ? node->then : node->els;
+        if (!node->then)
+            node->then = empty_block();
+        return node;
+    }
+    case NodeKind::ND_WHILE:
+        node->cond = fold_expr(node->cond);
+        node->then = fold_stmt(node->then);
+        if (is_num(node->cond, 0))
+            return nullptr;
+        if (!node->then)
+            node->then = empty_block();
+        // while (1) は条件のないforにする
+        if (node->cond->kind == NodeKind::ND_NUM) {
+            node->kind = NodeKind::ND_FOR;
+            node->cond = nullptr;
+        }
+        return node;
+    case NodeKind::ND_FOR:
+        node->init = fold_expr(node->init);
+        node->cond = fold_expr(node->cond);
+        node->inc = fold_expr(node->inc);
+        node->then = fold_stmt(node->then);
+        if (node->cond && is_num(node->cond, 0))
+            return node->init;
+        if (node->cond && node->cond->kind == NodeKind::ND_NUM)
+            node->cond = nullptr;
+        if (!node->then)
+            node->then = empty_block();
+        return node;
+    case NodeKind::ND_BLOCK: {
+        std::vector<Node *> body;
+        for (auto stmt : *(node->body))
+            if (Node *s = fold_stmt(stmt))
+                body.push_back(s);
+        node->body = alloc_node_vec(*arena, body);
+        return node;
+    }
+    default:
+        return fold_expr(node);
+    }
+}
+
+static void fold(Function &fn) {
+    std::vector<Node *> code;
+    for (auto stmt : fn.code)
+        if (Node *s = fold_stmt(stmt))
+            code.push_back(s);
+    fn.code = code;
+}
+
+void optimize(std::vector<Function> &prog, Arena &a) {
+    arena = &a;
+    // 展開した後で畳み込むと、引数の定数が本体の式に伝わりやすい
+    if (opts.inlining)
+        inline_functions(prog, a);
+    for (auto &fn : prog)
+        if (opts.fold)
+            fold(fn);
+    // 畳み込んで定数になった引数で計算し、計算した値をもう一度畳み込む
+    if (opts.const_eval) {
+        eval_pure_calls(prog, a);
+        for (auto &fn : prog)
+            if (opts.fold)
+                fold(fn);
+    }
+    for (auto &fn : prog) {
+        // 展開してループの変数が定数になったところを畳み込む
+        if (opts.unroll_loops || opts.loop_invariant || opts.strength_reduce) {
+            optimize_loops(fn, a);
+            if (opts.fold)
+                fold(fn);
+        }
+        // 展開したループの後に残る変数の代入などを消す
+        if (opts.dead_code)
+            eliminate_dead_code(fn, a);
+        if (opts.cse)
+            eliminate_common_subexprs(fn, a);
+        if (opts.share_slots)
+            share_slots(fn);
+    }
+    // 呼び出しを展開したり計算したりして、呼ばれなくなった関数を消す
+    if (opts.dead_code)
+        remove_unused_functions(prog);
+}
@@ -2,45 +2,41 @@
 
 // ローカル変数 (変数の名前, オフセット)
 // paramsもここに含まれる
-static std::map<std::string, int> locals;
+static std::map<std::string, int, std::less<>> locals;
+
+// ノードを確保するアリーナ
+static Arena *arena;
 
 static Node *new_node(NodeKind kind, Node *lhs, Node *rhs) {
-    Node *node = static_cast<Node *>(calloc(1, sizeof(Node)));
-    node->kind = kind;
+    Node *node = alloc_node(*arena, kind);
     node->lhs = lhs;
     node->rhs = rhs;
     return node;
 }
 
 static Node *new_node_num(int val) {
-    Node *node = static_cast<Node *>(calloc(1, sizeof(Node)));
-    node->kind = NodeKind::ND_NUM;
+    Node *node = alloc_node(*arena, NodeKind::ND_NUM);
     node->val = val;
     return node;
 }
 
-static Node *new_node_lvar(const std::string &name) {
-    Node *node = static_cast<Node *>(calloc(1, sizeof(Node)));
-    node->kind = NodeKind::ND_LVAR;
-    if (locals.count(name) == 0) {
-        locals[name] = (locals.size() + 1) * 8;
-        node->offset = locals.at(name);
-    } else {
-        node->offset = locals.at(name);
-    }
+static Node *new_node_lvar(std::string_view name) {
+    Node *node = alloc_node(*arena, NodeKind::ND_LVAR);
+    auto it = locals.find(name);
+    if (it == locals.end())
+        it = locals.emplace(std::string(name), (locals.size() + 1) * 8).first;
+    node->offset = it->second;
     return node;
 }
 
 static Node *new_node_unary(NodeKind kind, Node *expr) {
-    Node *node = static_cast<Node *>(calloc(1, sizeof(Node)));
-    node->kind = kind;
+    Node *node = alloc_node(*arena, kind);
     node->lhs = expr;
     return node;
 }
 
 static Node *new_node_if(Node *cond, Node *then, Node *els) {
-    Node *node = static_cast<Node *>(calloc(1, sizeof(Node)));
-    node->kind = NodeKind::ND_IF;
+    Node *node = alloc_node(*arena, NodeKind::ND_IF);
     node->cond = cond;
     node->then = then;
     node->els = els;
@@ -48,16 +44,14 @@ static Node *new_node_if(Node *cond, Node *then, Node *els) {
 }
 
 static Node *new_node_while(Node *cond, Node *then) {
-    Node *node = static_cast<Node *>(calloc(1, sizeof(Node)));
-    node->kind = NodeKind::ND_WHILE;
+    Node *node = alloc_node(*arena, NodeKind::ND_WHILE);
     node->cond = cond;
     node->then = then;
     return node;
 }
 
 static Node *new_node_for(Node *init, Node *cond, Node *inc, Node *then) {
-    Node *node = static_cast<Node *>(calloc(1, sizeof(Node)));
-    node->kind = NodeKind::ND_FOR;
+    Node *node = alloc_node(*arena, NodeKind::ND_FOR);
     node->init = init;
     node->cond = cond;
     node->inc = inc;
@@ -65,18 +59,16 @@ static Node *new_node_for(Node *init, Node *cond, Node *inc, Node *then) {
     return node;
 }
 
-static Node *new_node_block(std::vector<Node *> *body) {
-    Node *node = static_cast<Node *>(calloc(1, sizeof(Node)));
-    node->kind = NodeKind::ND_BLOCK;
-    node->body = body;
+static Node *new_node_block(const std::vector<Node *> &body) {
+    Node *node = alloc_node(*arena, NodeKind::ND_BLOCK);
+    node->body = alloc_node_vec(*arena, body);
     return node;
 }
 
-static Node *new_node_funcall(const std::string &funcname, std::vector<Node *> *args) {
-    Node *node = static_cast<Node *>(calloc(1, sizeof(Node)));
-    node->kind = NodeKind::ND_FUNCALL;
-    node->funcname = funcname;
-    node->args = args;
+static Node *new_node_funcall(std::string_view funcname, const std::vector<Node *> &args) {
+    Node *node = alloc_node(*arena, NodeKind::ND_FUNCALL);
+    node->funcname = arena->strdup(funcname);
+    node->args = alloc_node_vec(*arena, args);
     return node;
 }
 
@@ -104,28 +96,28 @@ static Node *new_node_funcall(const std::string &funcname, std::vector<Node *> *
 
 */
 
-static Function function(std::list<Token> &tokens);
-static std::vector<Node *> read_func_params(std::list<Token> &tokens);
-static Node *stmt(std::list<Token> &tokens);
-static Node *expr(std::list<Token> &tokens);
-static Node *assign(std::list<Token> &tokens);
-static Node *equality(std::list<Token> &tokens);
-static Node *relational(std::list<Token> &tokens);
-static Node *add(std::list<Token> &tokens);
-static Node *mul(std::list<Token> &tokens);
-static Node *unary(std::list<Token> &tokens);
-static Node *primary(std::list<Token> &tokens);
-
-std::vector<Function> program(std::list<Token> &tokens) {
+static Function function(TokenStream &tokens);
+static std::vector<Node *> read_func_params(TokenStream &tokens);
+static Node *stmt(TokenStream &tokens);
+static Node *expr(TokenStream &tokens);
+static Node *assign(TokenStream &tokens);
+static Node *equality(TokenStream &tokens);
+static Node *relational(TokenStream &tokens);
+static Node *add(TokenStream &tokens);
+static Node *mul(TokenStream &tokens);
+static Node *unary(TokenStream &tokens);
+static Node *primary(TokenStream &tokens);
+
+std::vector<Function> program(TokenStream &tokens, Arena &a) {
+    arena = &a;
     std::vector<Function> prog;
-    // tokens.empty()使えばTK_EOFいらないのでは?
-    while (tokens.front().kind != TokenKind::TK_EOF) {
+    while (tokens.peek().kind != TokenKind::TK_EOF) {
         prog.push_back(function(tokens));
     }
     return prog;
 }
 
-static std::vector<Node *> read_func_params(std::list<Token> &tokens) {
+static std::vector<Node *> read_func_params(TokenStream &tokens) {
     if (consume(tokens, ")"))
         return {};
 
@@ -139,10 +131,10 @@ static std::vector<Node *> read_func_params(std::list<Token> &tokens) {
     return params;
 }
 
-static Function function(std::list<Token> &tokens) {
+static Function function(TokenStream &tokens) {
     locals.clear();
 
-    std::string name = expect_ident(tokens);
+    std::string name(expect_ident(tokens));
     expect(tokens, "(");
     std::vector<Node *> params = read_func_params(tokens);
     expect(tokens, "{");
@@ -156,7 +148,7 @@ static Function function(std::list<Token> &tokens) {
         .code = code, .name = name, .params = params, .stack_size = int(locals.size()) * 8};
 }
 
-static Node *stmt(std::list<Token> &tokens) {
+static Node *stmt(TokenStream &tokens) {
     if (consume_keyword(tokens, TokenKind::TK_RETURN)) {
         Node *node = new_node_unary(NodeKind::ND_RETURN, expr(tokens));
         expect(tokens, ";");
@@ -200,9 +192,9 @@ static Node *stmt(std::list<Token> &tokens) {
         return new_node_for(init, cond, inc, then);
     }
     if (consume(tokens, "{")) {
-        std::vector<Node *> *body = new std::vector<Node *>();
+        std::vector<Node *> body;
         while (!consume(tokens, "}")) {
-            body->push_back(stmt(tokens));
+            body.push_back(stmt(tokens));
         }
         return new_node_block(body);
     }
@@ -212,16 +204,16 @@ static Node *stmt(std::list<Token> &tokens) {
     return node;
 }
 
-static Node *expr(std::list<Token> &tokens) { return assign(tokens); }
+static Node *expr(TokenStream &tokens) { return assign(tokens); }
 
-static Node *assign(std::list<Token> &tokens) {
+static Node *assign(TokenStream &tokens) {
     Node *node = equality(tokens);
     if (consume(tokens, "="))
         node = new_node(NodeKind::ND_ASSIGN, node, assign(tokens));
     return node;
 }
 
-static Node *equality(std::list<Token> &tokens) {
+static Node *equality(TokenStream &tokens) {
     Node *node = relational(tokens);
     for (;;) {
         if (consume(tokens, "=="))
@@ -233,7 +225,7 @@ static Node *equality(std::list<Token> &tokens) {
     }
 }
 
-static Node *relational(std::list<Token> &tokens) {
+static Node *relational(TokenStream &tokens) {
     Node *node = add(tokens);
 
     for (;;) {
@@ -250,7 +242,7 @@ static Node *relational(std::list<Token> &tokens) {
     }
 }
 
-static Node *add(std::list<Token> &tokens) {
+static Node *add(TokenStream &tokens) {
     Node *node = mul(tokens);
 
     for (;;) {
@@ -263,7 +255,7 @@ static Node *add(std::list<Token> &tokens) {
     }
 }
 
-static Node *mul(std::list<Token> &tokens) {
+static Node *mul(TokenStream &tokens) {
     Node *node = unary(tokens);
 
     for (;;) {
@@ -276,7 +268,7 @@ static Node *mul(std::list<Token> &tokens) {
     }
 }
 
-static Node *unary(std::list<Token> &tokens) {
+static Node *unary(TokenStream &tokens) {
     if (consume(tokens, "+"))
         return unary(tokens);
     if (consume(tokens, "-"))
@@ -284,21 +276,21 @@ static Node *unary(std::list<Token> &tokens) {
     return primary(tokens);
 }
 
-static std::vector<Node *> *func_args(std::list<Token> &tokens) {
-    std::vector<Node *> *args = new std::vector<Node *>();
+static std::vector<Node *> func_args(TokenStream &tokens) {
+    std::vector<Node *> args;
     if (consume(tokens, ")"))
         return args;
 
-    args->push_back(expr(tokens));
+    args.push_back(expr(tokens));
     while (consume(tokens, ",")) {
-        args->push_back(expr(tokens));
+        args.push_back(expr(tokens));
     }
 
     expect(tokens, ")");
     return args;
 }
 
-static Node *primary(std::list<Token> &tokens) {
+static Node *primary(TokenStream &tokens) {
     // 次のトークンが"("なら、"(" expr ")"のはず
     if (consume(tokens, "(")) {
         Node *node = expr(tokens);
@@ -306,14 +298,13 @@ static Node *primary(std::list<Token> &tokens) {
         return node;
     }
     // ident
-    auto t = consume_ident(tokens);
-    if (t) {
+    if (const Token *t = consume_ident(tokens)) {
         // 関数呼び出し
         if (consume(tokens, "(")) {
-            std::vector<Node *> *args = func_args(tokens);
-            return new_node_funcall(t.value().str, args);
+            std::vector<Node *> args = func_args(tokens);
+            return new_node_funcall(t->str, args);
         }
-        return new_node_lvar(t.value().str);
+        return new_node_lvar(t->str);
     }
     // そうでなければ数値のはず
     return new_node_num(expect_number(tokens));
@@ -0,0 +1,320 @@
+#include "9cc.h"
+
+#include <set>
+
+// SSA形式の中間表現に対する最適化
+
+static void for_each_use(IR &ir, const std::function<void(int &)> &f) {
+    if (ir.a >= 0)
+        f(ir.a);
+    if (ir.b >= 0)
+        f(ir.b);
+    for (int &arg : ir.args)
+        f(arg);
+}
+
+static bool is_terminator(IROp op) { return op == IROp::IR_RET || op == IROp::IR_JMP || op == IROp::IR_BR; }
+
+// 疎な条件付き定数伝播 (Wegman, Zadeck)
+// 値は未定 (TOP)、定数、定数でない (BOTTOM) のどれか
+struct Lattice {
+    enum Kind { TOP, CONST, BOTTOM } kind = TOP;
+    long val = 0;
+};
+
+static bool eval(IROp op, long a, long b, long &val) {
+    switch (op) {
+    case IROp::IR_ADD:
+        val = (unsigned long)a + b;
+        return true;
+    case IROp::IR_SUB:
+        val = (unsigned long)a - b;
+        return true;
+    case IROp::IR_MUL:
+        val = (unsigned long)a * b;
+        return true;
+    case IROp::IR_DIV:
+        // ゼロ除算とオーバーフローは実行時に任せる
+        if (b == 0 || (a == INT64_MIN && b == -1))
+            return false;
+        val = a / b;
+        return true;
+    case IROp::IR_EQ:
+        val = a == b;
+        return true;
+    case IROp::IR_NE:
+        val = a != b;
+        return true;
+    case IROp::IR_LT:
+        val = a < b;
+        return true;
+    case IROp::IR_LE:
+        val = a <= b;
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void sccp(IRFunc &fn) {
+    std::vector<Lattice> vals(fn.nvregs);
+    for (int v : fn.params)
+        vals[v].kind = Lattice::BOTTOM;
+
+    // 各仮想レジスタを使う命令
+    std::vector<std::vector<std::pair<BasicBlock *, int>>> uses(fn.nvregs);
+    for (auto bb : fn.bbs)
+        for (int i = 0; i < int(bb->irs.size()); i++)
+            for_each_use(bb->irs[i], [&](int &v) { uses[v].push_back({bb, i}); });
+
+    std::vector<bool> reached(fn.bbs.size());
+    std::set<std::pair<BasicBlock *, BasicBlock *>> edges;
+    std::vector<std::pair<BasicBlock *, BasicBlock *>> flow_work = {{nullptr, fn.bbs[0]}};
+    std::vector<int> ssa_work;
+
+    auto set = [&](int v, Lattice l) {
+        Lattice &cur = vals[v];
+        if (cur.kind == l.kind && (l.kind != Lattice::CONST || cur.val == l.val))
+            return;
+        // 定数同士で値が違うことはSSAの性質上ないが、念のためBOTTOMにする
+        if (cur.kind == Lattice::CONST && l.kind == Lattice::CONST)
+            l.kind = Lattice::BOTTOM;
+        if (cur.kind == Lattice::BOTTOM)
+            return;
+        cur = l;
+        ssa_work.push_back(v);
+    };
+
+    auto visit = [&](BasicBlock *bb, IR &ir) {
+        switch (ir.op) {
+        case IROp::IR_IMM:
+            set(ir.dst, {Lattice::CONST, ir.imm});
+            return;
+        case IROp::IR_MOV:
+            set(ir.dst, vals[ir.a]);
+            return;
+        case IROp::IR_CALL:
+            set(ir.dst, {Lattice::BOTTOM});
+            return;
+        case IROp::IR_PHI: {
+            Lattice l;
+            for (size_t i = 0; i < ir.args.size(); i++) {
+                if (!edges.count({ir.from[i], bb}))
+                    continue;
+                Lattice &a = vals[ir.args[i]];
+                if (a.kind == Lattice::TOP)
+                    continue;
+                if (a.kind == Lattice::BOTTOM || (l.kind == Lattice::CONST && l.val != a.val)) {
+                    l.kind = Lattice::BOTTOM;
+                    break;
+                }
+                l = a;
+            }
+            set(ir.dst, l);
+            return;
+        }
+        case IROp::IR_RET:
+            return;
+        case IROp::IR_JMP:
+            flow_work.push_back({bb, ir.then});
+            return;
+        case IROp::IR_BR: {
+            Lattice &c = vals[ir.a];
+            if (c.kind == Lattice::TOP)
+                return;
+            if (c.kind == Lattice::BOTTOM || c.val)
+                flow_work.push_back({bb, ir.then});
+            if (c.kind == Lattice::BOTTOM || !c.val)
+                flow_work.push_back({bb, ir.els});
+            return;
+        }
+        default: {
+            Lattice &a = vals[ir.a];
+            Lattice &b = vals[ir.b];
+            if (a.kind == Lattice::BOTTOM || b.kind == Lattice::BOTTOM) {
+                set(ir.dst, {Lattice::BOTTOM});
+                return;
+            }
+            if (a.kind == Lattice::TOP || b.kind == Lattice::TOP)
+                return;
+            long val;
+            if (eval(ir.op, a.val, b.val, val))
+                set(ir.dst, {Lattice::CONST, val});
+            else
+                set(ir.dst, {Lattice::BOTTOM});
+            return;
+        }
+        }
+    };
+
+    while (!flow_work.empty() || !ssa_work.empty()) {
+        while (!flow_work.empty()) {
+            auto [from, to] = flow_work.back();
+            flow_work.pop_back();
+            if (from && !edges.insert({from, to}).second)
+                continue;
+            if (reached[to->id]) {
+                // 新しい辺が増えたのでphiだけ評価し直す
+                for (auto &ir : to->irs) {
+                    if (ir.op != IROp::IR_PHI)
+                        break;
+                    visit(to, ir);
+                }
+                continue;
+            }
+            reached[to->id] = true;
+            for (auto &ir : to->irs)
+                visit(to, ir);
+        }
+        while (!ssa_work.empty()) {
+            int v = ssa_work.back();
+            ssa_work.pop_back();
+            for (auto [bb, i] : uses[v])
+                if (reached[bb->id])
+                    visit(bb, bb->irs[i]);
+        }
+    }
+
+    // 定数になった値を即値に置き換え、行き先の決まった分岐をジャンプにする
+    for (auto bb : fn.bbs) {
+        if (!reached[bb->id])
+            continue;
+        for (auto &ir : bb->irs) {
+            if (ir.op == IROp::IR_BR && vals[ir.a].kind == Lattice::CONST) {
+                ir = IR{.op = IROp::IR_JMP, .then = vals[ir.a].val ? ir.then : ir.els};
+                continue;
+            }
+            if (ir.dst < 0 || ir.op == IROp::IR_CALL || ir.op == IROp::IR_IMM)
+                continue;
+            if (vals[ir.dst].kind == Lattice::CONST)
+                ir = IR{.op = IROp::IR_IMM, .dst = ir.dst, .imm = vals[ir.dst].val};
+        }
+        // 即値になったphiがあっても、phiはブロックの先頭にまとめておく
+        std::stable_partition(bb->irs.begin(), bb->irs.end(),
+                              [](const IR &ir) { return ir.op == IROp::IR_PHI; });
+    }
+    // 到達しないブロックへ向かう分岐は、もうジャンプになっている
+    update_cfg(fn);
+}
+
+// コピー伝播
+// movと、すべての値が同じphiを取り除き、使う側で元の値を直接参照する
+static void copyprop(IRFunc &fn) {
+    std::vector<int> repl(fn.nvregs);
+    for (int v = 0; v < fn.nvregs; v++)
+        repl[v] = v;
+    std::function<int(int)> find = [&](int v) { return repl[v] == v ? v : repl[v] = find(repl[v]); };
+
+    // phiの値が置き換わると、別のphiが同じ値ばかりになることがある
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (auto bb : fn.bbs) {
+            for (auto &ir : bb->irs) {
+                if (ir.dst < 0 || find(ir.dst) != ir.dst)
+                    continue;
+                int src = -1;
+                if (ir.op == IROp::IR_MOV) {
+                    src = find(ir.a);
+                } else if (ir.op == IROp::IR_PHI) {
+                    for (int arg : ir.args) {
+                        int a = find(arg);
+                        if (a == ir.dst || a == src)
+                            continue;
+                        if (src >= 0) {
+                            src = -1;
+                            break;
+                        }
+                        src = a;
+                    }
+                }
+                if (src >= 0 && src != ir.dst) {
+                    repl[ir.dst] = src;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    for (auto bb : fn.bbs) {
+        std::vector<IR> irs;
+        for (auto &ir : bb->irs) {
+            if (ir.dst >= 0 && find(ir.dst) != ir.dst)
+                continue;
+            for_each_use(ir, [&](int &v) { v = find(v); });
+            irs.push_back(ir);
+        }
+        bb->irs = irs;
+    }
+}
+
+// 使われない命令の削除
+// 副作用のある命令と制御の命令から使われている値を辿り、辿り着かなかった命令を消す
+static void dce(IRFunc &fn) {
+    std::vector<IR *> defs(fn.nvregs);
+    for (auto bb : fn.bbs)
+        for (auto &ir : bb->irs)
+            if (ir.dst >= 0)
+                defs[ir.dst] = &ir;
+
+    std::vector<bool> live(fn.nvregs);
+    std::vector<IR *> work;
+    for (auto bb : fn.bbs)
+        for (auto &ir : bb->irs)
+            if (ir.op == IROp::IR_CALL || is_terminator(ir.op))
+                work.push_back(&ir);
+
+    while (!work.empty()) {
+        IR *ir = work.back();
+        work.pop_back();
+        for_each_use(*ir, [&](int &v) {
+            if (live[v])
+                return;
+            live[v] = true;
+            if (defs[v])
+                work.push_back(defs[v]);
+        });
+    }
+
+    for (auto bb : fn.bbs) {
+        std::vector<IR> irs;
+        for (auto &ir : bb->irs)
+            if (ir.dst < 0 || live[ir.dst] || ir.op == IROp::IR_CALL)
+                irs.push_back(ir);
+        bb->irs = irs;
+    }
+}
+
+struct Pass {
+    const char *name;
+    bool Options::*enabled;
+    void (*run)(IRFunc &);
+};
+
+static const Pass passes[] = {
+    {"sccp", &Options::sccp, sccp},
+    {"copyprop", &Options::copyprop, copyprop},
+    {"dce", &Options::dce, dce},
+};
+
+void run_passes(IRFunc &fn) {
+    if (opts.dump_ir)
+        dump_ir(fn, "initial");
+    // 有効なパスがなければSSA形式を経由しない
+    if (std::none_of(std::begin(passes), std::end(passes), [](const Pass &pass) { return opts.*pass.enabled; }))
+        return;
+    to_ssa(fn);
+    if (opts.dump_ir)
+        dump_ir(fn, "ssa");
+
+    for (auto &pass : passes) {
+        if (!(opts.*pass.enabled))
+            continue;
+        pass.run(fn);
+        if (opts.dump_ir)
+            dump_ir(fn, pass.name);
+    }
+
+    from_ssa(fn);
+    if (opts.dump_ir)
+        dump_ir(fn, "out of ssa");
+}
@@ -0,0 +1,276 @@
+#include "9cc.h"
+
+// 命令列に対するピープホール最適化
+// 主にスタックマシンのコード生成が出すpush/popの組や、変数のアドレスの計算を簡約する
+
+static bool is_reg(const Operand &op, Reg reg) { return op.kind == Operand::REG && op.reg == reg; }
+
+// オペランドがregを読むか (メモリのベースやインデックスとして使う場合も含む)
+static bool reads_operand(const Operand &op, Reg reg) {
+    if (op.kind == Operand::MEM && op.scale && op.index == reg)
+        return true;
+    return (op.kind == Operand::REG || op.kind == Operand::MEM) && op.reg == reg;
+}
+
+static bool reads(const Insn &insn, Reg reg) {
+    const Operand &a = insn.a;
+    const Operand &b = insn.b;
+    switch (insn.op) {
+    case Op::MOV:
+    case Op::LEA:
+        return (a.kind == Operand::MEM && reads_operand(a, reg)) || reads_operand(b, reg);
+    case Op::IMUL1:
+        return reg == Reg::RAX || reads_operand(a, reg);
+    case Op::MOVZB:
+    case Op::SETCC:
+        return reg == Reg::RAX;
+    case Op::CQO:
+        return reg == Reg::RAX;
+    case Op::IDIV:
+        return reg == Reg::RAX || reg == Reg::RDX || reads_operand(a, reg);
+    case Op::PUSH:
+        return reg == Reg::RSP || reads_operand(a, reg);
+    case Op::POP:
+        return reg == Reg::RSP;
+    case Op::CALL:
+    case Op::TAILCALL:
+        // 引数のレジスタ。可変長引数の関数のためにalも読む
+        return reg == Reg::RAX || reg == Reg::RSP ||
+               std::find(argreg.begin(), argreg.end(), reg) != argreg.end();
+    case Op::RET:
+        return reg == Reg::RAX || reg == Reg::RSP;
+    case Op::LABEL:
+    case Op::JMP:
+    case Op::JCC:
+        return false;
+    default:
+        return reads_operand(a, reg) || reads_operand(b, reg);
+    }
+}
+
+static bool writes(const Insn &insn, Reg reg) {
+    switch (insn.op) {
+    case Op::CMP:
+    case Op::JMP:
+    case Op::JCC:
+    case Op::LABEL:
+    case Op::RET:
+    case Op::TAILCALL:
+        return false;
+    case Op::SETCC:
+        return reg == Reg::RAX;
+    case Op::CQO:
+        return reg == Reg::RDX;
+    case Op::IDIV:
+    case Op::IMUL1:
+        return reg == Reg::RAX || reg == Reg::RDX;
+    case Op::PUSH:
+        return reg == Reg::RSP;
+    case Op::POP:
+        return reg == Reg::RSP || is_reg(insn.a, reg);
+    case Op::CALL:
+        // caller-savedのレジスタは呼び出しで壊れる
+        return reg == Reg::RAX || reg == Reg::RCX || reg == Reg::RDX || reg == Reg::RSI ||
+               reg == Reg::RDI || (Reg::R8 <= reg && reg <= Reg::R11);
+    default:
+        return is_reg(insn.a, reg);
+    }
+}
+
+// オペランドの値を変えるか (メモリならアドレスに使うレジスタを変えるか)
+static bool clobbers(const Insn &insn, const Operand &op) {
+    if (op.kind == Operand::MEM && op.scale && writes(insn, op.index))
+        return true;
+    return op.kind != Operand::IMM && writes(insn, op.reg);
+}
+
+static bool writes_memory(const Insn &insn) {
+    return insn.op == Op::CALL || insn.op == Op::TAILCALL || (insn.op != Op::CMP && insn.a.kind == Operand::MEM);
+}
+
+// 基本ブロックの途中でしか簡約しない
+static bool is_barrier(const Insn &insn) {
+    return insn.op == Op::LABEL || insn.op == Op::JMP || insn.op == Op::JCC || insn.op == Op::CALL ||
+           insn.op == Op::TAILCALL || insn.op == Op::RET;
+}
+
+// 消した命令は印を付けるだけにして、1回の走査が終わってからまとめて詰める
+// 走査の間は命令の位置が変わらないので、ラベルの位置も走査の最初に1回求めればよい
+static thread_local std::vector<bool> removed;
+static thread_local std::map<int, size_t> labels;
+
+// iより後ろで、消していない最初の命令の位置
+static size_t next_insn(const std::vector<Insn> &insns, size_t i) {
+    for (i++; i < insns.size() && removed[i]; i++)
+        ;
+    return i;
+}
+
+// iより前で、消していない最後の命令の位置。なければinsns.size()
+static size_t prev_insn(const std::vector<Insn> &insns, size_t i) {
+    while (i-- > 0)
+        if (!removed[i])
+            return i;
+    return insns.size();
+}
+
+// i番目の命令の後でregの値が使われないか
+// ジャンプは数回まで先を辿り、わからなければ使われるものとする
+static bool dead_after(const std::vector<Insn> &insns, size_t i, Reg reg, int depth = 4) {
+    for (size_t j = next_insn(insns, i); j < insns.size(); j = next_insn(insns, j)) {
+        const Insn &insn = insns[j];
+        if (reads(insn, reg))
+            return false;
+        if (writes(insn, reg))
+            return true;
+        if (insn.op == Op::RET || insn.op == Op::TAILCALL)
+            return true;
+        if (insn.op == Op::JMP || insn.op == Op::JCC) {
+            if (depth == 0)
+                return false;
+            auto target = labels.find(insn.label);
+            if (target == labels.end() || !dead_after(insns, target->second, reg, depth - 1))
+                return false;
+            if (insn.op == Op::JMP)
+                return true;
+        }
+    }
+    return false;
+}
+
+// 簡約を1回試す。変更したらtrueを返す
+static bool simplify(std::vector<Insn> &insns, size_t i) {
+    Insn &insn = insns[i];
+    size_t n = next_insn(insns, i);
+    Insn *next = n < insns.size() ? &insns[n] : nullptr;
+
+    // mov r, r
+    if (insn.op == Op::MOV && insn.a == insn.b) {
+        removed[i] = true;
+        return true;
+    }
+
+    // mov r, rbp; sub r, N => lea r, [rbp-N]
+    if (insn.op == Op::MOV && insn.a.kind == Operand::REG && is_reg(insn.b, Reg::RBP) && next &&
+        next->op == Op::SUB && next->a == insn.a && next->b.kind == Operand::IMM) {
+        insn = Insn{.op = Op::LEA, .a = insn.a, .b = Operand::mem(Reg::RBP, -next->b.val)};
+        removed[n] = true;
+        return true;
+    }
+
+    // lea r, [rbp-N]; ...; mov x, [r] => ...; mov x, [rbp-N] (rがその後使われなければ)
+    if (insn.op == Op::LEA && !insn.b.scale) {
+        Reg r = insn.a.reg;
+        for (size_t j = n; j < insns.size(); j = next_insn(insns, j)) {
+            Insn &cur = insns[j];
+            if (is_barrier(cur))
+                break;
+            if (reads(cur, r)) {
+                if (cur.op != Op::MOV)
+                    break;
+                Operand *mem = nullptr;
+                if (cur.a.kind == Operand::MEM && cur.a.reg == r && !cur.a.scale && !is_reg(cur.b, r))
+                    mem = &cur.a;
+                else if (cur.b.kind == Operand::MEM && cur.b.reg == r && !cur.b.scale)
+                    mem = &cur.b;
+                if (!mem || !(is_reg(cur.a, r) || dead_after(insns, j, r)))
+                    break;
+                *mem = Operand::mem(insn.b.reg, insn.b.val + mem->val);
+                removed[i] = true;
+                return true;
+            }
+            if (writes(cur, r) || writes(cur, insn.b.reg))
+                break;
+        }
+    }
+
+    // 使われない値を作るだけの命令
+    if ((insn.op == Op::MOV || insn.op == Op::LEA) && insn.a.kind == Operand::REG &&
+        insn.a.reg != Reg::RSP && insn.a.reg != Reg::RBP && dead_after(insns, i, insn.a.reg)) {
+        removed[i] = true;
+        return true;
+    }
+
+    // jmp L; L: => L:
+    if ((insn.op == Op::JMP || insn.op == Op::JCC)) {
+        for (size_t j = n; j < insns.size() && insns[j].op == Op::LABEL; j = next_insn(insns, j)) {
+            if (insns[j].label == insn.label) {
+                removed[i] = true;
+                return true;
+            }
+        }
+    }
+
+    // push x; ...; pop y => ...; mov y, x
+    // 間の命令がrspもxも変えなければ、スタックを経由しなくてよい
+    // xを直前のleaやメモリからのmovで求めていれば、xが変わってもpopの位置で求め直せばよい
+    // ただしmov rax, [rax]のように求めるのにx自身を使っていれば求め直せない
+    if (insn.op == Op::PUSH) {
+        Operand x = insn.a;
+        Op op = Op::MOV;
+        size_t p = prev_insn(insns, i);
+        if (p < insns.size() && insns[p].a == x && !reads_operand(insns[p].b, x.reg) &&
+            (insns[p].op == Op::LEA || (insns[p].op == Op::MOV && insns[p].b.kind == Operand::MEM))) {
+            op = insns[p].op;
+            x = insns[p].b;
+        }
+        for (size_t j = n; j < insns.size(); j = next_insn(insns, j)) {
+            Insn &cur = insns[j];
+            if (cur.op == Op::POP) {
+                cur = Insn{.op = op, .a = cur.a, .b = x};
+                removed[i] = true;
+                return true;
+            }
+            if (is_barrier(cur) || reads(cur, Reg::RSP) || writes(cur, Reg::RSP))
+                break;
+            if (clobbers(cur, x))
+                break;
+            if (op == Op::MOV && x.kind == Operand::MEM && writes_memory(cur))
+                break;
+        }
+    }
+
+    // mov [m], r; ...; mov x, [m] => mov [m], r; ...; mov x, r
+    if (insn.op == Op::MOV && insn.a.kind == Operand::MEM && insn.b.kind == Operand::REG) {
+        const Operand &m = insn.a;
+        Reg r = insn.b.reg;
+        for (size_t j = n; j < insns.size(); j = next_insn(insns, j)) {
+            Insn &cur = insns[j];
+            if (cur.op == Op::MOV && cur.b == m && cur.a.kind == Operand::REG) {
+                cur.b = r;
+                return true;
+            }
+            if (is_barrier(cur) || writes_memory(cur) || writes(cur, r) || clobbers(cur, m))
+                break;
+        }
+    }
+    return false;
+}
+
+int peephole(AsmFunc &fn) {
+    auto count = [&] {
+        return std::count_if(fn.insns.begin(), fn.insns.end(),
+                             [](const Insn &insn) { return insn.op != Op::LABEL; });
+    };
+    int before = count();
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        removed.assign(fn.insns.size(), false);
+        labels.clear();
+        for (size_t i = 0; i < fn.insns.size(); i++)
+            if (fn.insns[i].op == Op::LABEL)
+                labels[fn.insns[i].label] = i;
+
+        for (size_t i = 0; i < fn.insns.size(); i = next_insn(fn.insns, i))
+            while (!removed[i] && simplify(fn.insns, i))
+                changed = true;
+
+        size_t len = 0;
+        for (size_t i = 0; i < fn.insns.size(); i++)
+            if (!removed[i])
+                fn.insns[len++] = fn.insns[i];
+        fn.insns.resize(len);
+    }
+    return before - count();
+}
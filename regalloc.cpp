@@ -0,0 +1,209 @@
+#include "9cc.h"
+
+// 線形スキャンによるレジスタ割り当て
+
+static void for_each_use(const IR &ir, const std::function<void(int)> &f) {
+    if (ir.a >= 0)
+        f(ir.a);
+    if (ir.b >= 0)
+        f(ir.b);
+    for (int arg : ir.args)
+        f(arg);
+}
+
+// 集合は生きている仮想レジスタの番号を昇順に並べて持つので、
+// 手間は仮想レジスタの総数ではなく、実際に生きている数に比例する
+void liveness(IRFunc &fn) {
+    int n = fn.nvregs;
+    std::vector<std::vector<int>> use(fn.bbs.size());
+    std::vector<std::vector<int>> def(fn.bbs.size());
+
+    // どのブロックで最後に読んだか、書いたかを覚えて、ブロックごとの重複を避ける
+    std::vector<int> used_in(n, -1), defined_in(n, -1);
+    for (auto bb : fn.bbs) {
+        for (auto &ir : bb->irs) {
+            for_each_use(ir, [&](int v) {
+                if (defined_in[v] != bb->id && used_in[v] != bb->id) {
+                    used_in[v] = bb->id;
+                    use[bb->id].push_back(v);
+                }
+            });
+            if (ir.dst >= 0 && defined_in[ir.dst] != bb->id) {
+                defined_in[ir.dst] = bb->id;
+                def[bb->id].push_back(ir.dst);
+            }
+        }
+        std::sort(use[bb->id].begin(), use[bb->id].end());
+        std::sort(def[bb->id].begin(), def[bb->id].end());
+        bb->live_in = use[bb->id];
+        bb->live_out.clear();
+    }
+
+    // 入口で生きている集合が変わったブロックの前のブロックだけを計算し直す
+    // 後ろのブロックから先に取り出すよう、前から順に積んでおく
+    std::vector<BasicBlock *> work(fn.bbs.begin(), fn.bbs.end());
+    std::vector<bool> queued(fn.bbs.size(), true);
+    std::vector<int> tmp;
+    while (!work.empty()) {
+        BasicBlock *bb = work.back();
+        work.pop_back();
+        queued[bb->id] = false;
+
+        bb->live_out.clear();
+        for (auto succ : bb->succ) {
+            tmp.clear();
+            std::set_union(bb->live_out.begin(), bb->live_out.end(), succ->live_in.begin(), succ->live_in.end(),
+                           std::back_inserter(tmp));
+            bb->live_out.swap(tmp);
+        }
+
+        // in = use ∪ (out - def)
+        std::vector<int> rest, in;
+        std::set_difference(bb->live_out.begin(), bb->live_out.end(), def[bb->id].begin(), def[bb->id].end(),
+                            std::back_inserter(rest));
+        std::set_union(use[bb->id].begin(), use[bb->id].end(), rest.begin(), rest.end(), std::back_inserter(in));
+        if (in == bb->live_in)
+            continue;
+        bb->live_in.swap(in);
+        for (auto pred : bb->pred) {
+            if (!queued[pred->id]) {
+                queued[pred->id] = true;
+                work.push_back(pred);
+            }
+        }
+    }
+}
+
+struct Interval {
+    int vreg;
+    int start = INT32_MAX;
+    int end = -1;
+    bool across_call = false;
+
+    void add(int pos) {
+        start = std::min(start, pos);
+        end = std::max(end, pos);
+    }
+};
+
+// 命令に通し番号を振り、各仮想レジスタの生存区間を求める
+// 区間に穴は考えず、最初と最後の位置だけを持つ
+static std::vector<Interval> build_intervals(IRFunc &fn) {
+    std::vector<Interval> intervals(fn.nvregs);
+    for (int v = 0; v < fn.nvregs; v++)
+        intervals[v].vreg = v;
+
+    // 引数は関数の入口で定義される
+    for (int v : fn.params)
+        intervals[v].add(0);
+
+    std::vector<std::pair<int, int>> calls; // (位置, 戻り値の仮想レジスタ)
+    int pos = 1;
+    for (auto bb : fn.bbs) {
+        int from = pos;
+        int to = pos + bb->irs.size() - 1;
+        for (auto &ir : bb->irs) {
+            for_each_use(ir, [&](int v) { intervals[v].add(pos); });
+            if (ir.dst >= 0)
+                intervals[ir.dst].add(pos);
+            if (ir.op == IROp::IR_CALL)
+                calls.push_back({pos, ir.dst});
+            pos++;
+        }
+        for (int v : bb->live_in)
+            intervals[v].add(from);
+        for (int v : bb->live_out)
+            intervals[v].add(to);
+    }
+
+    // ブロックの入口で生きている区間は、先頭の命令の位置から始まる
+    // 先頭が呼び出しでも、呼び出しの戻り値でなければ呼び出しをまたいでいる
+    // callsは位置の順に並んでいるので、区間の始まり以降の呼び出しだけを見る
+    for (auto &iv : intervals) {
+        auto it = std::lower_bound(calls.begin(), calls.end(), std::make_pair(iv.start, INT32_MIN));
+        for (; it != calls.end() && it->first < iv.end; it++) {
+            if (it->second != iv.vreg) {
+                iv.across_call = true;
+                break;
+            }
+        }
+    }
+    return intervals;
+}
+
+void alloc_regs(IRFunc &fn) {
+    liveness(fn);
+    std::vector<Interval> intervals = build_intervals(fn);
+
+    // 使われない引数の区間は[0, 0]になる。場所を割り当てると、同じく0から始まる引数と
+    // レジスタを共有してしまい、入口でのコピーが生きている引数を壊すので、場所を持たせない
+    std::vector<Interval *> order;
+    for (auto &iv : intervals)
+        if (iv.end > 0)
+            order.push_back(&iv);
+    std::sort(order.begin(), order.end(),
+              [](Interval *x, Interval *y) { return x->start < y->start; });
+
+    fn.locs.assign(fn.nvregs, Location{});
+    std::vector<Interval *> active;
+    std::vector<bool> used(allocreg.size());
+    std::vector<bool> saved(num_callee_saved);
+
+    auto spill = [&](Interval *iv) {
+        fn.locs[iv->vreg].reg = -1;
+        fn.locs[iv->vreg].slot = fn.nslots++;
+    };
+
+    for (auto cur : order) {
+        // 終わった区間のレジスタを解放する
+        // 同じ命令で読まれて終わる区間と書かれて始まる区間は同じレジスタを共有できる
+        for (auto it = active.begin(); it != active.end();) {
+            if ((*it)->end <= cur->start) {
+                used[fn.locs[(*it)->vreg].reg] = false;
+                it = active.erase(it);
+            } else {
+                it++;
+            }
+        }
+
+        // 関数呼び出しをまたぐ区間はcallee-savedレジスタにしか置けない
+        // そうでなければcaller-savedレジスタを優先して使う
+        int reg = -1;
+        if (!cur->across_call)
+            for (int r = num_callee_saved; r < int(allocreg.size()) && reg < 0; r++)
+                if (!used[r])
+                    reg = r;
+        for (int r = 0; r < num_callee_saved && reg < 0; r++)
+            if (!used[r])
+                reg = r;
+
+        if (reg < 0) {
+            // 空きがなければ、最も遅くまで生きている区間をスピルする
+            Interval *victim = nullptr;
+            for (auto iv : active) {
+                int r = fn.locs[iv->vreg].reg;
+                if (cur->across_call && r >= num_callee_saved)
+                    continue;
+                if (!victim || victim->end < iv->end)
+                    victim = iv;
+            }
+            if (!victim || victim->end <= cur->end) {
+                spill(cur);
+                continue;
+            }
+            reg = fn.locs[victim->vreg].reg;
+            spill(victim);
+            active.erase(std::find(active.begin(), active.end(), victim));
+        }
+
+        used[reg] = true;
+        fn.locs[cur->vreg].reg = reg;
+        active.push_back(cur);
+        if (reg < num_callee_saved)
+            saved[reg] = true;
+    }
+
+    for (int r = 0; r < num_callee_saved; r++)
+        if (saved[r])
+            fn.used_callee_saved.push_back(r);
+}
@@ -0,0 +1,120 @@
+#include "9cc.h"
+
+// 生存区間が重ならない変数に同じスタックスロットを割り当てる
+// 変数の参照に評価順の番号を振り、最初から最後の参照までを生存区間とする
+// ループの中で参照する変数は、次の周回でも値を使うかもしれないのでループ全体を区間に含める
+// 前にしか飛ばない分岐 (if, return) では、番号の小さい参照が後で実行されることはない
+
+struct VarRange {
+    int start = -1;
+    int end = -1;
+    std::vector<int> refs; // 参照の番号
+};
+
+static std::map<int, VarRange> vars; // オフセットごとの生存区間
+static std::vector<std::pair<int, int>> loops;
+static std::vector<Node *> lvars; // 書き換えるノード
+static int pos;
+
+static void ref(Node *node) {
+    VarRange &iv = vars[node->offset];
+    if (iv.start < 0)
+        iv.start = pos;
+    iv.end = pos;
+    iv.refs.push_back(pos++);
+    lvars.push_back(node);
+}
+
+// コード生成と同じ順番で辿る
+static void walk(Node *node) {
+    if (!node)
+        return;
+    switch (node->kind) {
+    case NodeKind::ND_LVAR:
+        ref(node);
+        return;
+    case NodeKind::ND_ASSIGN:
+        // 右辺を評価してから代入する
+        walk(node->rhs);
+        walk(node->lhs);
+        return;
+    case NodeKind::ND_FUNCALL:
+        for (auto arg : *(node->args))
+            walk(arg);
+        return;
+    case NodeKind::ND_IF:
+        walk(node->cond);
+        walk(node->then);
+        walk(node->els);
+        return;
+    case NodeKind::ND_WHILE:
+    case NodeKind::ND_FOR: {
+        walk(node->init);
+        int start = pos++;
+        walk(node->cond);
+        walk(node->then);
+        walk(node->inc);
+        loops.push_back({start, pos++});
+        return;
+    }
+    case NodeKind::ND_BLOCK:
+        for (auto stmt : *(node->body))
+            walk(stmt);
+        return;
+    default:
+        walk(node->lhs);
+        walk(node->rhs);
+        return;
+    }
+}
+
+void share_slots(Function &fn) {
+    vars.clear();
+    loops.clear();
+    lvars.clear();
+    pos = 0;
+
+    // 引数は関数の入口で書き込まれる
+    for (auto param : fn.params)
+        ref(param);
+    for (auto stmt : fn.code)
+        walk(stmt);
+
+    for (auto &[offset, iv] : vars) {
+        for (auto [start, end] : loops) {
+            if (std::any_of(iv.refs.begin(), iv.refs.end(), [&](int r) { return start <= r && r <= end; })) {
+                iv.start = std::min(iv.start, start);
+                iv.end = std::max(iv.end, end);
+            }
+        }
+    }
+
+    // 区間の始まりの順に、空いているスロットを割り当てる
+    std::vector<std::pair<int, int>> order; // (start, offset)
+    for (auto &[offset, iv] : vars)
+        order.push_back({iv.start, offset});
+    std::sort(order.begin(), order.end());
+
+    std::vector<int> slot_end; // スロットごとの、使っている区間の終わり
+    std::map<int, int> new_offset;
+    for (auto [start, offset] : order) {
+        size_t slot = 0;
+        while (slot < slot_end.size() && slot_end[slot] >= start)
+            slot++;
+        if (slot == slot_end.size())
+            slot_end.push_back(0);
+        slot_end[slot] = vars[offset].end;
+        new_offset[offset] = (slot + 1) * 8;
+    }
+
+    // 同じノードを2回書き換えないようにする
+    std::sort(lvars.begin(), lvars.end());
+    lvars.erase(std::unique(lvars.begin(), lvars.end()), lvars.end());
+    for (auto node : lvars)
+        node->offset = new_offset[node->offset];
+
+    int size = slot_end.size() * 8;
+    if (opts.report)
+        fprintf(stderr, "slots: %s: %d -> %d bytes\n", fn.name.c_str(), fn.stack_size, size);
+    fn.stack_size = size;
+}
@@ -0,0 +1,76 @@
+#include "9cc.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+Source::~Source() {
+    if (map)
+        munmap(map, map_len);
+}
+
+Source Source::from_string(std::string s) {
+    Source src;
+    src.buf = std::move(s);
+    src.view = src.buf;
+    return src;
+}
+
+// ファイルの中身をmmapでそのままメモリに載せる
+// tokenize()はマップしたページを直接読むので、コピーは起きない
+Source Source::from_file(const std::string &path) {
+    if (path == "-")
+        return from_fd(STDIN_FILENO);
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        error("ファイルを開けません: %s", path.c_str());
+
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        error("ファイルの情報を取得できません: %s", path.c_str());
+
+    // 通常のファイルでなければmmapできないので読み込む
+    // 空のファイルもmmapできない
+    if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+        Source src = from_fd(fd);
+        close(fd);
+        return src;
+    }
+
+    void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        error("ファイルをマップできません: %s", path.c_str());
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+
+    Source src;
+    src.map = p;
+    src.map_len = st.st_size;
+    src.view = std::string_view(static_cast<const char *>(p), st.st_size);
+    return src;
+}
+
+Source Source::from_fd(int fd) {
+    std::string s;
+    char buf[64 * 1024];
+    for (;;) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0)
+            error("読み込みに失敗しました");
+        if (n == 0)
+            break;
+        s.append(buf, n);
+    }
+    return from_string(std::move(s));
+}
+
+Source::Source(Source &&other) noexcept
+    : buf(std::move(other.buf)), map(other.map), map_len(other.map_len) {
+    // bufを指している場合はムーブ先のbufを指し直す
+    view = map ? other.view : std::string_view(buf);
+    other.map = nullptr;
+    other.map_len = 0;
+    other.view = {};
+}
@@ -0,0 +1,196 @@
+#include "9cc.h"
+
+// 中間表現とSSA形式の間の変換
+
+// Cooper, Harvey, Kennedy "A Simple, Fast Dominance Algorithm" で各ブロックの直接支配節を求める
+static std::vector<int> dominators(IRFunc &fn) {
+    int n = fn.bbs.size();
+
+    // 逆後順の番号を振る
+    std::vector<int> rpo;
+    std::vector<int> order(n, -1);
+    std::vector<bool> visited(n);
+    std::function<void(BasicBlock *)> dfs = [&](BasicBlock *bb) {
+        visited[bb->id] = true;
+        for (auto succ : bb->succ)
+            if (!visited[succ->id])
+                dfs(succ);
+        rpo.push_back(bb->id);
+    };
+    dfs(fn.bbs[0]);
+    std::reverse(rpo.begin(), rpo.end());
+    for (int i = 0; i < int(rpo.size()); i++)
+        order[rpo[i]] = i;
+
+    std::vector<int> idom(n, -1);
+    idom[0] = 0;
+    auto intersect = [&](int a, int b) {
+        while (a != b) {
+            while (order[a] > order[b])
+                a = idom[a];
+            while (order[b] > order[a])
+                b = idom[b];
+        }
+        return a;
+    };
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int id : rpo) {
+            if (id == 0)
+                continue;
+            int new_idom = -1;
+            for (auto pred : fn.bbs[id]->pred) {
+                if (idom[pred->id] < 0)
+                    continue;
+                new_idom = new_idom < 0 ? pred->id : intersect(pred->id, new_idom);
+            }
+            if (idom[id] != new_idom) {
+                idom[id] = new_idom;
+                changed = true;
+            }
+        }
+    }
+    return idom;
+}
+
+// 支配辺境
+static std::vector<std::vector<int>> frontiers(IRFunc &fn, const std::vector<int> &idom) {
+    std::vector<std::vector<int>> df(fn.bbs.size());
+    for (auto bb : fn.bbs) {
+        if (bb->pred.size() < 2)
+            continue;
+        for (auto pred : bb->pred) {
+            for (int runner = pred->id; runner != idom[bb->id]; runner = idom[runner]) {
+                if (std::find(df[runner].begin(), df[runner].end(), bb->id) == df[runner].end())
+                    df[runner].push_back(bb->id);
+            }
+        }
+    }
+    return df;
+}
+
+static void for_each_use(IR &ir, const std::function<void(int &)> &f) {
+    if (ir.a >= 0)
+        f(ir.a);
+    if (ir.b >= 0)
+        f(ir.b);
+    for (int &arg : ir.args)
+        f(arg);
+}
+
+// 生きている場所にだけphiを置く (pruned SSA)
+void to_ssa(IRFunc &fn) {
+    update_cfg(fn);
+    liveness(fn);
+    int nvars = fn.nvregs;
+    BasicBlock *entry = fn.bbs[0];
+
+    // 初期化されずに使われる変数は0で初期化しておく
+    std::vector<bool> is_param(nvars);
+    for (int v : fn.params)
+        is_param[v] = true;
+    std::vector<IR> init;
+    for (int v = 0; v < nvars; v++)
+        if (std::binary_search(entry->live_in.begin(), entry->live_in.end(), v) && !is_param[v])
+            init.push_back(IR{.op = IROp::IR_IMM, .dst = v, .imm = 0});
+    entry->irs.insert(entry->irs.begin(), init.begin(), init.end());
+
+    // 各仮想レジスタを定義しているブロック
+    std::vector<std::vector<int>> defs(nvars);
+    for (int v : fn.params)
+        defs[v].push_back(0);
+    for (auto bb : fn.bbs)
+        for (auto &ir : bb->irs)
+            if (ir.dst >= 0 && (defs[ir.dst].empty() || defs[ir.dst].back() != bb->id))
+                defs[ir.dst].push_back(bb->id);
+
+    std::vector<int> idom = dominators(fn);
+    std::vector<std::vector<int>> df = frontiers(fn, idom);
+
+    // phiを置く
+    // has_phi[b]はブロックbにphiを置いた変数。変数ごとに作り直さないよう番号で区別する
+    std::vector<int> has_phi(fn.bbs.size(), -1);
+    for (int v = 0; v < nvars; v++) {
+        std::vector<int> work = defs[v];
+        while (!work.empty()) {
+            int b = work.back();
+            work.pop_back();
+            for (int d : df[b]) {
+                BasicBlock *bb = fn.bbs[d];
+                if (has_phi[d] == v || !std::binary_search(bb->live_in.begin(), bb->live_in.end(), v))
+                    continue;
+                has_phi[d] = v;
+                IR phi{.op = IROp::IR_PHI, .dst = v};
+                phi.args.assign(bb->pred.size(), v);
+                phi.from = bb->pred;
+                bb->irs.insert(bb->irs.begin(), phi);
+                work.push_back(d);
+            }
+        }
+    }
+
+    // 支配木を辿って名前を付け直す
+    std::vector<std::vector<int>> children(fn.bbs.size());
+    for (size_t i = 1; i < fn.bbs.size(); i++)
+        children[idom[i]].push_back(i);
+
+    std::vector<std::vector<int>> stacks(nvars);
+    auto new_name = [&](int v) {
+        int r = fn.nvregs++;
+        stacks[v].push_back(r);
+        return r;
+    };
+    for (int &v : fn.params)
+        v = new_name(v);
+
+    std::function<void(BasicBlock *)> rename = [&](BasicBlock *bb) {
+        std::vector<int> pushed;
+        for (auto &ir : bb->irs) {
+            if (ir.op != IROp::IR_PHI) {
+                for_each_use(ir, [&](int &v) {
+                    if (stacks[v].empty())
+                        error("SSAへの変換に失敗しました: %s v%d", fn.name.c_str(), v);
+                    v = stacks[v].back();
+                });
+            }
+            if (ir.dst >= 0) {
+                pushed.push_back(ir.dst);
+                ir.dst = new_name(ir.dst);
+            }
+        }
+        for (auto succ : bb->succ) {
+            for (auto &ir : succ->irs) {
+                if (ir.op != IROp::IR_PHI)
+                    break;
+                for (size_t i = 0; i < ir.from.size(); i++)
+                    if (ir.from[i] == bb)
+                        ir.args[i] = stacks[ir.args[i]].back();
+            }
+        }
+        for (int child : children[bb->id])
+            rename(fn.bbs[child]);
+        for (int v : pushed)
+            stacks[v].pop_back();
+    };
+    rename(entry);
+}
+
+// phiを前のブロックでのコピーに置き換える
+// 前のブロックでは一時的な仮想レジスタに入れ、phiの位置でそこから移すので、
+// 辺を分割しなくても値が入れ替わったり失われたりしない
+void from_ssa(IRFunc &fn) {
+    std::vector<std::pair<BasicBlock *, IR>> copies;
+    for (auto bb : fn.bbs) {
+        for (auto &ir : bb->irs) {
+            if (ir.op != IROp::IR_PHI)
+                break;
+            int tmp = fn.nvregs++;
+            for (size_t i = 0; i < ir.from.size(); i++)
+                copies.push_back({ir.from[i], IR{.op = IROp::IR_MOV, .dst = tmp, .a = ir.args[i]}});
+            ir = IR{.op = IROp::IR_MOV, .dst = ir.dst, .a = tmp};
+        }
+    }
+    for (auto &[bb, ir] : copies)
+        bb->irs.insert(bb->irs.end() - 1, ir);
+}
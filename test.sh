@@ -9,16 +9,73 @@ int sub(int x, int y) { return x-y; }
 int add6(int a, int b, int c, int d, int e, int f) {
   return a+b+c+d+e+f;
 }
+long sub8(long a, long b, long c, long d, long e, long f, long g, long h) {
+  return a+b+c+d+e+f-g-h;
+}
 EOF
 
+# 引数はそのまま9ccに渡す (例: ./test.sh -fregalloc)
+FLAGS="$*"
+
+# -cならアセンブリではなくオブジェクトファイルが出力される
+OUT=tmp.s
+if [[ " $FLAGS " == *" -c "* ]]; then
+  OUT=tmp.o
+fi
+
+# 9ccでコンパイルして実行し、終了コードをactualに入れる
+# -fjitか-fvmなら9ccがそのまま実行する
+run() {
+  if [[ " $FLAGS " == *" -fjit "* || " $FLAGS " == *" -fvm "* ]]; then
+    ./9cc $FLAGS "$@"
+    actual="$?"
+    return
+  fi
+  ./9cc $FLAGS "$@" > $OUT
+  g++ -o tmp $OUT tmp2.o
+  ./tmp
+  actual="$?"
+}
+
 try() {
   expected="$1"
   input="$2"
 
-  ./9cc "$input" > tmp.s
-  g++ -o tmp tmp.s tmp2.o
-  ./tmp
-  actual="$?"
+  run "$input"
+  check "$expected" "$input"
+}
+
+# ファイルと標準入力から読む場合
+try_file() {
+  expected="$1"
+  input="$2"
+
+  echo "$input" > tmp.c
+  run tmp.c
+  check "$expected" "$input"
+  run - < tmp.c
+  check "$expected" "$input"
+}
+
+# 終了コードではわからない最適化は、-freportの出力に期待する行があるかで調べる
+# 数えた値が他の最適化で変わらないよう、テスト全体のフラグは使わず指定したフラグだけで動かす
+# try_report フラグ 期待する行 プログラム
+try_report() {
+  flags="$1"
+  expected="$2"
+  input="$3"
+
+  if ./9cc $flags -freport "$input" 2>&1 >/dev/null | grep -qF "$expected"; then
+    echo "$input => $expected"
+  else
+    echo "$input => '$expected' expected in -freport output"
+    exit 1
+  fi
+}
+
+check() {
+  expected="$1"
+  input="$2"
 
   if [ "$actual" = "$expected" ]; then
     echo "$input => $actual"
@@ -85,8 +142,11 @@ try 3 'main() { return ret3(); }'
 try 5 'main() { return ret5(); }'
 try 8 'main() { return add(3, 5); }'
 try 2 'main() { return sub(5, 3); }'
+try 0 'main() { return sub(2, 4) < 0; }'
 try 8 'main() { return add(ret3(), ret5()); }'
 try 21 'main() { return add6(1,2,3,4,5,6); }'
+try 6 'main() { return sub8(1,2,3,4,5,6,7,8); }'
+try 13 'main() { x=1; return sub8(1,2,3,4,5,6,7,8) + sub8(x,x,x,x,x,x,add6(0,0,0,0,0,x),x) + add(ret3(), 0); }'
 
 try 32 'main() { return ret32(); } ret32() { return 32; }'
 
@@ -94,7 +154,79 @@ try 7 'main() { return add2(3, 4); } add2(x, y) { return x + y; }'
 try 1 'main() { return sub2(4, 3); } sub2(x, y) { return x - y; }'
 try 2 'main() { return sub2(5, 10); } sub2(x, y) { a = 4; b = 11; return x - a + b - y; }'
 try 9 'main() { return sub6(1,2,3,4,5,6); } sub6(a,b,c,d,e,f) { return f-a+e-b+d-c; }'
+try 55 'main() { return f(1); } f(x) { a=x; b=a+1; c=b+1; d=c+1; e=d+1; g=e+1; h=g+1; i=h+1; j=i+1; k=j+1; return a+b+c+d+e+g+h+i+j+k; }'
+try 62 'main() { return f9(1,2,3,4,5,6,7,8,9) + f8(1,2,3,4,5,6,7,8); } f9(a,b,c,d,e,f,g,h,i) { return i*(a+b+c+d+e+f+g+h)/12; } f8(a,b,c,d,e,f,g,h) { return sub8(h,g,f,e,d,c,b,a) - add(g, h) + 20; }'
 try 55 'main() { return fib(9); } fib(x) { if (x <= 1) return 1; return fib(x - 1) + fib(x - 2); }'
 try 120 'main() { return fact(5); } fact(x) { if (x > 1) return x * fact(x - 1); else return 1; }'
+try 7 'main() { a = 1; return a + (a = 3) + (a = 3); }'
+try 36 'main() { a=1; b=2; c=3; d=4; e=5; f=6; g=7; h=8; return a+b+c+d+e+f+g+h; }'
+try 45 'main() { a=1; b=2; c=3; d=4; e=5; f=6; g=7; h=8; i=9; x=ret3(); return a+b+c+d+e+f+g+h+i+x-3; }'
+try 5 'main() { return sub2(add2(1, 2) * 3, (x = 4)); } add2(x, y) { return x + y; } sub2(x, y) { return x - y; }'
+try 16 'main() { return sum(10000, 0) - 50005000 + 16; } sum(n, acc) { if (n == 0) return acc; return sum(n - 1, acc + n); }'
+try 2 'main() { return ping(10001); } ping(n) { if (n == 0) return 1; return pong(n - 1); } pong(n) { if (n == 0) return 2; return ping(n - 1); }'
+try 5 'main() { return swap(3, 4, 1); } swap(a, b, n) { if (n == 0) return a * 2 - b; return swap(b, a, n - 1); }'
+try 27 'main() { return sq(add2(1, 2)) + twice(3) * 3; } add2(x, y) { return x + y; } sq(x) { return x * x; } twice(x) { y = x; y = add2(y, y); return y; }'
+try 4 'main() { x = 1; y = inc(x) + inc(x); return x * 10 + y - 10; } inc(a) { return a + 1; }'
+try 11 'main() { s = 0; for (i = 0; i < 4; i = i + 1) s = s + tri(i); return s + even(4); } tri(n) { t = n * (n + 1); return t / 2; } even(n) { if (n == 0) return 1; return odd(n - 1); } odd(n) { if (n == 0) return 0; return even(n - 1); }'
+try 6 'main() { return f(3); } f(x) { if (x) return add(x, 3); return 0; }'
+
+try 47 'main() { x=3; return - -x + 0 + x*1 - (x-x) + x*0 + 41; }'
+try 4 'main() { x=0; return (x=4)*0 + x; }'
+try 8 'main() { i=0; while(0) i=1; if (1) i=i+3; else i=i+5; for(;1;) return i+5; }'
+try 6 'main() { for (i=6; 0;) i=1; return i; }'
+
+try 10 'main() { a=0; for (i=0; i<5; i=i+1) { j=0; while (j<i) { a=a+1; j=j+1; } } return a; }'
+try 7 'main() { x=2; if (x==2) y=7; else y=x; z=y; return z; }'
+try 4 'main() { if (ret3()) x=4; return x; }'
+try 5 'main() { i=0; while (i!=5) i=i+1; return i; }'
+try 11 'main() { a=12; b=3; return a/b + a/4 + 2*b - (b-1) + a*1 - 12; }'
+try 20 'main() { x=2; y=x+3; return (y*x) + (10+x) - x; }'
+try 112 'main() { x=ret3()+4; return x*0 + x*1 + x*2 + x*3 + x*5 + x*8 + x*9 - x*18 + x*6; }'
+try 55 'main() { x=ret3()*33; return x/1 + x/2 + x/3 + x/7 + x/8 + x/10 + x/(0-9) - 150; }'
+try 14 'main() { x=0-ret3()*33; return x/2 + x/3 + x/7 + x/8 + x/10 + x/(0-9) + 120; }'
+try 2 'main() { a=3; b=3; if (a==b) if (a>=b) if (a<=b) if (a>b) return 1; else return 2; return 3; }'
+try 51 'main() { a=ret3(); b=ret5(); x=a*b + a*b; if (x>0) y=a*b+1; else y=a*b-1; a=1; return x + y + a*b; }'
+try 48 'main() { a=2; b=3; s=a*b; i=0; while (i<3) { s=s+a*b; a=a+1; i=i+1; } return s + a*b; }'
+try 44 'main() { x=ret3(); y=x; x=x+1; return (y+1)*10 + x; }'
+try 38 'main() { x=0; y=(x=ret3())+1; x=5; z=(x=ret3())+1; return x*10 + y + z; }'
+try 15 'main() { a=ret3(); b=a+1; if (b>3) a=10; else a=0; return a+1 + b; }'
+try 35 'main() { s=ret3()-3; for (i=0; i<5; i=i+1) s=s+i*i; return s + i; }'
+try 83 'main() { s=ret3()-3; for (i=3; i<100; i=i+1) s=s+i; return s - 4864 + i - 100; }'
+try 83 'main() { s=ret3()-3; t=0; for (i=0; i<=41; i=i+2) { s=s+i; t=t+1; } return s - 400 + t + i; }'
+try 195 'main() { a=ret3(); b=ret5(); s=0; i=0; while (i<10) { s = s + a*b + i; i = i + 1; } return s; }'
+try 1 'main() { d=ret3()-3; s=0; i=0; while (i<d) { s = s + 10/d; i=i+1; } return s + 1; }'
+try 120 'main() { s=0; for (i=0; i<ret5(); i=i+1) s = s + i*12; return s; }'
+try 99 'main() { s=0; i=ret3(); while (i < 20) { s = s + i*4 - 3*i; i = i + 2; } return s; }'
+try 2 'main() { x = ret3() + 1; x = 2; y = x * 7; y + ret5(); return x; 5; ret3(); }'
+try 8 'main() { a = ret3(); if (a - 3) return 1; else { return a + ret5(); a = 9; } return 7; }'
+try 12 'main() { s = 0; i = 0; while (i < 3) { t = i * 2; t = i * 4; s = s + t; i = i + 1; } return s; }'
+try 4 'main() { x = 1; for (;;) { if (x == 4) return x; x = x + 1; } return 9; }'
+try 6 'main() { a = 1; b = (a = ret5()) + 1; return b; }'
+try 3 'main() { return f(); } f() { return ret3(); } g() { return f() + 1; }'
+try 91 'main() { return f(5, 6, 7); } f(a, b, c) { x = a * 2; y = ret3() + 1 + 2 + 3 + 4 + 5 + 6 + 7 + 8 + 9 + 10 + 11 + 12; return x + y; }'
+try 10 'main() { return f(1, 2, ret3()); } f(a, b, n) { if (n == 0) return 7; return f(0, 0, n - 1) + 1; }'
+try 19 'main() { x=ret3(); return add(x, sq(4)); } sq(n) { return n*n; }'
+try 55 'main() { return sum(10); } sum(n) { s=0; for (i=1; i<=n; i=i+1) s=s+i; return s; }'
+try 6 'main() { x=ret3(); return tw(x) + tw(1); } tw(n) { return n+1; }'
+try 3 'main() { return big(3000000) / 1000000; } big(n) { i=0; while (i<n) i=i+1; return i; }'
+try 7 'main() { return f(0); } f(x) { if (x) return 10/x; return 7; }'
+try 2 'main() { return h(1) / 1000000000 / 1000000000; } h(x) { return x * 2000000000 * 1000000000; }'
+try 10 'main() { s=0; i=0; while (i<3) { if (i>0) s=s+t; t=i*10; i=i+1; } return s; }'
+try 23 'main() { a=3; b=a*2; c=b+1; d=0; for (i=0; i<c; i=i+1) { e=i; d=d+e; } f=d-b+a; return f+g(1, 2); } g(x, y) { z=x+y; w=z*2; return w-x; }'
+
+try_report -finline 'inline: main: tw' 'main() { s=0; i=0; while (i<3) { s = s + tw(i); i = i + 1; } return s; } tw(n) { return n+1; }'
+try_report '-fjit -fdead-code' 'dead-code: g: unused function removed' 'main() { return f(); } f() { return ret3(); } g() { return f() + 1; }'
+try_report -fpeephole 'peephole: main: 10 instructions removed' 'main() { a=3; b=a+4; return a*b; }'
+try_report -fshare-slots 'slots: f: 32 -> 8 bytes' 'main() { return f(2); } f(n) { a=n+1; b=a*2; c=b+3; return c; }'
+try_report -fconst-eval 'const-eval: main: sq = 16' 'main() { x=ret3(); return add(x, sq(4)); } sq(n) { return n*n; }'
+try_report -fcse 'cse: main: 4 nodes deduplicated' 'main() { a=ret3(); b=ret5(); c=2; x=a*b*c; y=a*b*c; return x+y; }'
+try_report '-funroll-loops -floop-invariant -fstrength-reduce' 'loop: main: 1 unrolled, 1 invariants hoisted, 1 induction variables reduced' 'main() { a=ret3(); s=0; for (i=0; i<ret5(); i=i+1) { s = s + i*4 + a*a; for (j=0; j<2; j=j+1) s=s+j; } return s; }'
+
+try_file 89 'main() { return fib(10); }
+fib(x) {
+  if (x <= 1)
+    return 1;
+  return fib(x - 1) + fib(x - 2);
+}'
 
 echo OK
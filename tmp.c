@@ -0,0 +1,6 @@
+main() { return fib(10); }
+fib(x) {
+  if (x <= 1)
+    return 1;
+  return fib(x - 1) + fib(x - 2);
+}
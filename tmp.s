@@ -0,0 +1,40 @@
+.intel_syntax noprefix
+.global main
+main:
+.L.body.main.1:
+  mov rax, 89
+.L.return.main.0:
+  ret
+.global fib
+fib:
+  push rbp
+  mov rbp, rsp
+  sub rsp, 16
+  mov QWORD PTR [rbp-8], rdi
+.L.body.fib.1:
+  mov rax, QWORD PTR [rbp-8]
+  cmp rax, 1
+  jg .L.end.fib.2
+  mov rax, 1
+  jmp .L.return.fib.0
+.L.end.fib.2:
+  mov rax, QWORD PTR [rbp-8]
+  sub rax, 1
+  mov rdi, rax
+  mov rax, 0
+  call fib
+  push rax
+  sub rsp, 8
+  mov rax, QWORD PTR [rbp-8]
+  sub rax, 2
+  mov rdi, rax
+  mov rax, 0
+  call fib
+  add rsp, 8
+  mov rdi, rax
+  pop rax
+  add rax, rdi
+.L.return.fib.0:
+  mov rsp, rbp
+  pop rbp
+  ret
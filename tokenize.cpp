@@ -1,5 +1,11 @@
 #include "9cc.h"
 
+#include <array>
+
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
 void error(const char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
@@ -8,144 +14,276 @@ void error(const char *fmt, ...) {
     exit(1);
 }
 
-bool consume(std::list<Token> &tokens, const std::string &op) {
-    auto token = tokens.front();
+bool consume(TokenStream &tokens, std::string_view op) {
+    const Token &token = tokens.peek();
     if (token.kind != TokenKind::TK_RESERVED || token.str != op) {
         return false;
     }
-    tokens.pop_front();
+    tokens.next();
     return true;
 }
 
-std::optional<Token> consume_ident(std::list<Token> &tokens) {
-    auto token = tokens.front();
+const Token *consume_ident(TokenStream &tokens) {
+    const Token &token = tokens.peek();
     if (token.kind != TokenKind::TK_IDENT)
-        return std::nullopt;
-    tokens.pop_front();
-    return token;
+        return nullptr;
+    tokens.next();
+    return &token;
 }
 
-bool consume_keyword(std::list<Token> &tokens, TokenKind kind) {
-    auto token = tokens.front();
+bool consume_keyword(TokenStream &tokens, TokenKind kind) {
+    const Token &token = tokens.peek();
     if (token.kind != kind) {
         return false;
     }
-    tokens.pop_front();
+    tokens.next();
     return true;
 }
 
-void expect(std::list<Token> &tokens, const std::string &op) {
-    auto token = tokens.front();
+void expect(TokenStream &tokens, std::string_view op) {
+    const Token &token = tokens.peek();
     if (token.kind != TokenKind::TK_RESERVED || token.str != op)
-        error("'%s'ではありません", op.c_str());
+        error("'%.*s'ではありません", int(op.size()), op.data());
 
-    tokens.pop_front();
+    tokens.next();
 }
 
-int expect_number(std::list<Token> &tokens) {
-    auto token = tokens.front();
+int expect_number(TokenStream &tokens) {
+    const Token &token = tokens.peek();
     if (token.kind != TokenKind::TK_NUM)
         error("数ではありません: %s\n", token.to_string().c_str());
-    int val = token.val;
-    tokens.pop_front();
-    return val;
+    tokens.next();
+    return token.val;
 }
 
-std::string expect_ident(std::list<Token> &tokens) {
-    auto token = tokens.front();
+std::string_view expect_ident(TokenStream &tokens) {
+    const Token &token = tokens.peek();
     if (token.kind != TokenKind::TK_IDENT)
         error("識別子ではありません: %s\n", token.to_string().c_str());
-    std::string s = token.str;
-    tokens.pop_front();
-    return s;
+    tokens.next();
+    return token.str;
+}
+
+// 文字の種類。tokenize()はこの表で先頭の文字から処理を振り分ける
+enum CharClass : uint8_t {
+    CC_OTHER,  // トークンにならない文字
+    CC_SPACE,  // 空白
+    CC_DIGIT,  // 数字
+    CC_ALPHA,  // 識別子の先頭になる文字
+    CC_PUNCT,  // 1文字の記号
+    CC_PUNCT2, // 後ろに"="が続くと2文字の記号になる記号 (= < >)
+    CC_BANG,   // "!=" の "!"
+};
+
+static constexpr std::array<uint8_t, 256> make_char_class() {
+    std::array<uint8_t, 256> cls{};
+    for (char c : std::string_view(" \t\n\v\f\r"))
+        cls[uint8_t(c)] = CC_SPACE;
+    for (int c = '0'; c <= '9'; c++)
+        cls[c] = CC_DIGIT;
+    for (int c = 'a'; c <= 'z'; c++)
+        cls[c] = CC_ALPHA;
+    for (int c = 'A'; c <= 'Z'; c++)
+        cls[c] = CC_ALPHA;
+    cls['_'] = CC_ALPHA;
+    for (char c : std::string_view("+-*/(),;{}"))
+        cls[uint8_t(c)] = CC_PUNCT;
+    for (char c : std::string_view("=<>"))
+        cls[uint8_t(c)] = CC_PUNCT2;
+    cls['!'] = CC_BANG;
+    return cls;
+}
+
+static constexpr std::array<uint8_t, 256> char_class = make_char_class();
+
+static bool is_alnum(char c) {
+    uint8_t cls = char_class[uint8_t(c)];
+    return cls == CC_ALPHA || cls == CC_DIGIT;
+}
+
+// キーワードは (先頭の文字 ^ 長さ) の下位3bitで衝突なく引ける
+struct Keyword {
+    std::string_view str;
+    TokenKind kind;
+};
+
+static constexpr Keyword keywords[] = {
+    {"return", TokenKind::TK_RETURN}, {"if", TokenKind::TK_IF},   {"else", TokenKind::TK_ELSE},
+    {"while", TokenKind::TK_WHILE},   {"for", TokenKind::TK_FOR},
+};
+
+static constexpr size_t keyword_hash(std::string_view s) { return (uint8_t(s[0]) ^ s.size()) & 7; }
+
+static constexpr std::array<Keyword, 8> make_keyword_table() {
+    std::array<Keyword, 8> table{};
+    for (auto &kw : keywords) {
+        Keyword &slot = table[keyword_hash(kw.str)];
+        // 衝突した場合はここでコンパイルエラーになる
+        if (!slot.str.empty())
+            throw "keyword hash collision";
+        slot = kw;
+    }
+    return table;
+}
+
+static constexpr std::array<Keyword, 8> keyword_table = make_keyword_table();
+
+// 識別子ならTK_IDENT、キーワードならその種類を返す
+static TokenKind keyword_kind(std::string_view s) {
+    const Keyword &kw = keyword_table[keyword_hash(s)];
+    if (kw.str == s)
+        return kw.kind;
+    return TokenKind::TK_IDENT;
+}
+
+// s[i]から始まる、条件を満たす文字の並びの終わりの位置を返す
+// 16バイト (AVX2が使えれば32バイト) ずつまとめて調べ、末尾の半端はscalarで調べる
+#if defined(__AVX2__)
+
+static uint32_t in_range(__m256i v, char lo, char n) {
+    __m256i t = _mm256_sub_epi8(v, _mm256_set1_epi8(lo));
+    __m256i le = _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8(n)), t);
+    return _mm256_movemask_epi8(le);
+}
+
+static uint32_t space_mask(__m256i v) {
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '))) |
+           in_range(v, '\t', '\r' - '\t');
+}
+
+static uint32_t digit_mask(__m256i v) { return in_range(v, '0', 9); }
+
+static uint32_t alnum_mask(__m256i v) {
+    __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    return in_range(lower, 'a', 25) | in_range(v, '0', 9) |
+           _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+}
+
+template <class Mask, class Pred>
+static size_t scan(std::string_view s, size_t i, Mask mask, Pred pred) {
+    while (i + 32 <= s.size()) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s.data() + i));
+        uint32_t m = ~mask(v);
+        if (m)
+            return i + __builtin_ctz(m);
+        i += 32;
+    }
+    while (i < s.size() && pred(s[i]))
+        i++;
+    return i;
+}
+
+#elif defined(__SSE2__)
+
+static uint32_t in_range(__m128i v, char lo, char n) {
+    __m128i t = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+    __m128i le = _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(n)), t);
+    return _mm_movemask_epi8(le);
+}
+
+static uint32_t space_mask(__m128i v) {
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(' '))) |
+           in_range(v, '\t', '\r' - '\t');
+}
+
+static uint32_t digit_mask(__m128i v) { return in_range(v, '0', 9); }
+
+static uint32_t alnum_mask(__m128i v) {
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    return in_range(lower, 'a', 25) | in_range(v, '0', 9) |
+           _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+}
+
+template <class Mask, class Pred>
+static size_t scan(std::string_view s, size_t i, Mask mask, Pred pred) {
+    while (i + 16 <= s.size()) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s.data() + i));
+        uint32_t m = ~mask(v) & 0xffff;
+        if (m)
+            return i + __builtin_ctz(m);
+        i += 16;
+    }
+    while (i < s.size() && pred(s[i]))
+        i++;
+    return i;
 }
 
-std::list<Token> tokenize(const std::string &s) {
-    std::list<Token> tokens;
+#else
+
+template <class Mask, class Pred> static size_t scan(std::string_view s, size_t i, Mask, Pred pred) {
+    while (i < s.size() && pred(s[i]))
+        i++;
+    return i;
+}
+
+static const std::nullptr_t space_mask = nullptr;
+static const std::nullptr_t digit_mask = nullptr;
+static const std::nullptr_t alnum_mask = nullptr;
+
+#endif
+
+static bool is_space(char c) { return char_class[uint8_t(c)] == CC_SPACE; }
+static bool is_digit(char c) { return char_class[uint8_t(c)] == CC_DIGIT; }
+
+TokenStream tokenize(std::string_view s) {
+    TokenStream stream;
+    std::vector<Token> &tokens = stream.tokens;
     size_t i = 0;
     size_t len = s.size();
 
-    static auto startswith = [&](const std::string &t) { return s.substr(i, t.size()) == t; };
-    static auto is_alpha = [](char c) {
-        return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '_';
-    };
-    static auto is_alnum = [](char c) { return is_alpha(c) || ('0' <= c && c <= '9'); };
+    // トークンの数はおおよそ文字数の1/3程度なので、先に確保しておく
+    tokens.reserve(len / 3 + 1);
 
     while (i < len) {
-        if (isspace(s[i])) {
-            i++;
+        switch (char_class[uint8_t(s[i])]) {
+        case CC_SPACE:
+            // 1文字だけの空白が多いので、次の文字を見てから並びを調べる
+            if (i + 1 < len && is_space(s[i + 1]))
+                i = scan(s, i + 2, space_mask, is_space);
+            else
+                i++;
             continue;
-        }
-
-        // Multi-letter punctuator
-        if (startswith("==") || startswith("!=") || startswith("<=") || startswith(">=")) {
-            tokens.push_back(Token{.kind = TokenKind::TK_RESERVED, .str = s.substr(i, 2)});
-            i += 2;
-            continue;
-        }
-
-        // Single-letter punctuator
-        if (startswith("+") || startswith("-") || startswith("*") || startswith("/") ||
-            startswith("(") || startswith(")") || startswith("<") || startswith(">") ||
-            startswith("=") || startswith(",") || startswith(";") || startswith("{") ||
-            startswith("}")) {
-            tokens.push_back(Token{.kind = TokenKind::TK_RESERVED, .str = s.substr(i, 1)});
-            i++;
-            continue;
-        }
-
-        if (isdigit(s[i])) {
-            size_t j = i;
+        case CC_DIGIT: {
+            size_t j = scan(s, i + 1, digit_mask, is_digit);
             int n = 0;
-            while (isdigit(s[j])) {
-                n = n * 10 + (s[j] - '0');
-                j++;
-            }
-            tokens.push_back(Token{.kind = TokenKind::TK_NUM, .val = n});
+            for (size_t k = i; k < j; k++)
+                n = n * 10 + (s[k] - '0');
+            tokens.push_back(Token{.kind = TokenKind::TK_NUM, .val = n, .str = s.substr(i, j - i)});
             i = j;
             continue;
         }
-
-        if (startswith("return") && !is_alnum(s[i + 6])) {
-            tokens.push_back(Token{.kind = TokenKind::TK_RETURN, .str = "return"});
-            i += 6;
-            continue;
-        }
-
-        if (startswith("if") && !is_alnum(s[i + 2])) {
-            tokens.push_back(Token{.kind = TokenKind::TK_IF, .str = "if"});
-            i += 2;
-            continue;
-        }
-
-        if (startswith("else") && !is_alnum(s[i + 4])) {
-            tokens.push_back(Token{.kind = TokenKind::TK_ELSE, .str = "else"});
-            i += 4;
+        case CC_ALPHA: {
+            size_t j = scan(s, i + 1, alnum_mask, is_alnum);
+            std::string_view str = s.substr(i, j - i);
+            tokens.push_back(Token{.kind = keyword_kind(str), .str = str});
+            i = j;
             continue;
         }
-
-        if (startswith("while") && !is_alnum(s[i + 5])) {
-            tokens.push_back(Token{.kind = TokenKind::TK_WHILE, .str = "while"});
-            i += 5;
+        case CC_PUNCT:
+            tokens.push_back(Token{.kind = TokenKind::TK_RESERVED, .str = s.substr(i, 1)});
+            i++;
             continue;
+        case CC_PUNCT2:
+        case CC_BANG: {
+            // Multi-letter punctuator
+            if (i + 1 < len && s[i + 1] == '=') {
+                tokens.push_back(Token{.kind = TokenKind::TK_RESERVED, .str = s.substr(i, 2)});
+                i += 2;
+                continue;
+            }
+            if (char_class[uint8_t(s[i])] == CC_PUNCT2) {
+                tokens.push_back(Token{.kind = TokenKind::TK_RESERVED, .str = s.substr(i, 1)});
+                i++;
+                continue;
+            }
+            break;
         }
-
-        if (startswith("for") && !is_alnum(s[i + 3])) {
-            tokens.push_back(Token{.kind = TokenKind::TK_FOR, .str = "for"});
-            i += 3;
-            continue;
+        default:
+            break;
         }
 
-        if (is_alpha(s[i])) {
-            size_t j = i;
-            while (is_alnum(s[j])) {
-                j++;
-            }
-            tokens.push_back(Token{.kind = TokenKind::TK_IDENT, .str = s.substr(i, j - i)});
-            i = j;
-            continue;
-        }
+        error("トークナイズできません: %s", std::string(s.substr(i)).c_str());
     }
-    tokens.push_back(Token{.kind = TokenKind::TK_EOF});
-    return tokens;
+    tokens.push_back(Token{.kind = TokenKind::TK_EOF, .str = s.substr(len)});
+    return stream;
 }
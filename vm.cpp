@@ -0,0 +1,461 @@
+#include "9cc.h"
+
+#include <memory>
+
+// 抽象構文木をレジスタ型のバイトコードに変換し、VMで実行する
+// 関数を呼ぶときは引数を連続したレジスタに置き、そこから呼ばれた関数のフレームを始める
+// (引数がそのまま呼ばれた関数の引数のレジスタになり、戻り値は先頭のレジスタに入る)
+
+// 変換中の関数の状態
+static std::vector<VMInsn> *out;
+static std::map<std::string_view, int> func_index;
+static std::map<std::string_view, int> native_index;
+static std::vector<HostFunc> *used_natives; // CALLNで呼ぶホストの関数
+static int nvars; // ローカル変数のレジスタの数
+static int top;   // 使っていない一時レジスタの先頭
+static int max_top;
+
+static size_t emit(VMOp op, int a, int b = 0, int c = 0) {
+    out->push_back(VMInsn{op, a, b, c});
+    return out->size() - 1;
+}
+
+// ジャンプ先を今の位置にする
+static void patch(size_t jump) { (*out)[jump].a = out->size(); }
+
+static int new_reg() {
+    max_top = std::max(max_top, top + 1);
+    return top++;
+}
+
+static int var_reg(Node *node) { return node->offset / 8 - 1; }
+
+static bool has_assign(Node *node) {
+    if (!node)
+        return false;
+    if (node->kind == NodeKind::ND_ASSIGN)
+        return true;
+    if (node->kind == NodeKind::ND_FUNCALL) {
+        for (auto arg : *(node->args))
+            if (has_assign(arg))
+                return true;
+        return false;
+    }
+    return has_assign(node->lhs) || has_assign(node->rhs);
+}
+
+static int gen_expr(Node *node);
+static void gen_to(Node *node, int dst);
+
+// 変数のレジスタをそのまま使うと、後で評価される式の中の代入で
+// 値が書き換わってしまうのでコピーしておく
+static int protect(int r, bool clobbered) {
+    if (r >= nvars || !clobbered)
+        return r;
+    int t = new_reg();
+    emit(VMOp::MOV, t, r);
+    return t;
+}
+
+// 引数を連続したレジスタに置いて呼び出し、戻り値のあるレジスタを返す
+static int gen_call(Node *node) {
+    NodeVec &args = *(node->args);
+    int base = top;
+    for (size_t i = 0; i < args.size(); i++) {
+        top = base + i;
+        gen_to(args[i], new_reg());
+    }
+    // 引数がなくても戻り値のレジスタは要る
+    top = base;
+    new_reg();
+
+    auto it = func_index.find(node->funcname);
+    if (it != func_index.end()) {
+        emit(VMOp::CALL, base, it->second, args.size());
+        return base;
+    }
+
+    auto host = host_funcs.find(node->funcname);
+    if (host == host_funcs.end())
+        error("未定義の関数です: %.*s", int(node->funcname.size()), node->funcname.data());
+    if (host->second.nparams > 8)
+        error("VMから呼べる関数の引数は8個までです: %.*s", int(node->funcname.size()), node->funcname.data());
+    if (native_index.count(node->funcname) == 0) {
+        native_index[node->funcname] = used_natives->size();
+        used_natives->push_back(host->second);
+    }
+    emit(VMOp::CALLN, base, native_index[node->funcname], args.size());
+    return base;
+}
+
+static int gen_assign(Node *node) {
+    if (node->lhs->kind != NodeKind::ND_LVAR)
+        error("代入の左辺値が変数ではありません");
+    int v = var_reg(node->lhs);
+    gen_to(node->rhs, v);
+    return v;
+}
+
+// 式の値があるレジスタを返す。変数ならそのレジスタをそのまま使う
+static int gen_expr(Node *node) {
+    switch (node->kind) {
+    case NodeKind::ND_LVAR:
+        return var_reg(node);
+    case NodeKind::ND_ASSIGN:
+        return gen_assign(node);
+    case NodeKind::ND_FUNCALL:
+        return gen_call(node);
+    default: {
+        int r = new_reg();
+        gen_to(node, r);
+        return r;
+    }
+    }
+}
+
+static bool is_imm(Node *node) { return node->kind == NodeKind::ND_NUM && node->val != INT32_MIN; }
+
+static void gen_binop(VMOp op, Node *node, int dst) {
+    int saved = top;
+    int a = protect(gen_expr(node->lhs), has_assign(node->rhs));
+    int b = gen_expr(node->rhs);
+    emit(op, dst, a, b);
+    top = saved;
+}
+
+// 式の値をdstに入れる
+static void gen_to(Node *node, int dst) {
+    int saved = top;
+    switch (node->kind) {
+    case NodeKind::ND_NUM:
+        emit(VMOp::MOVI, dst, node->val);
+        return;
+    case NodeKind::ND_LVAR:
+    case NodeKind::ND_ASSIGN:
+    case NodeKind::ND_FUNCALL: {
+        int r = gen_expr(node);
+        if (r != dst)
+            emit(VMOp::MOV, dst, r);
+        top = saved;
+        return;
+    }
+    case NodeKind::ND_COMMA:
+        gen_expr(node->lhs);
+        top = saved;
+        gen_to(node->rhs, dst);
+        return;
+    case NodeKind::ND_ADD:
+        // 定数との足し算は即値を持つ命令にする
+        if (is_imm(node->rhs) || is_imm(node->lhs)) {
+            bool rhs_imm = is_imm(node->rhs);
+            Node *imm = rhs_imm ? node->rhs : node->lhs;
+            emit(VMOp::ADDI, dst, gen_expr(rhs_imm ? node->lhs : node->rhs), imm->val);
+            top = saved;
+            return;
+        }
+        gen_binop(VMOp::ADD, node, dst);
+        return;
+    case NodeKind::ND_SUB:
+        if (is_imm(node->rhs)) {
+            emit(VMOp::ADDI, dst, gen_expr(node->lhs), -node->rhs->val);
+            top = saved;
+            return;
+        }
+        gen_binop(VMOp::SUB, node, dst);
+        return;
+    case NodeKind::ND_MUL:
+        gen_binop(VMOp::MUL, node, dst);
+        return;
+    case NodeKind::ND_DIV:
+        gen_binop(VMOp::DIV, node, dst);
+        return;
+    case NodeKind::ND_EQ:
+        gen_binop(VMOp::EQ, node, dst);
+        return;
+    case NodeKind::ND_NE:
+        gen_binop(VMOp::NE, node, dst);
+        return;
+    case NodeKind::ND_LT:
+        gen_binop(VMOp::LT, node, dst);
+        return;
+    case NodeKind::ND_LE:
+        gen_binop(VMOp::LE, node, dst);
+        return;
+    default:
+        error("式ではありません");
+    }
+}
+
+// condがjump_ifと一致したらジャンプする命令を出力し、その位置を返す
+// 比較はジャンプと1つの命令にする
+static size_t gen_branch(Node *cond, bool jump_if) {
+    int saved = top;
+    size_t jump;
+    switch (cond->kind) {
+    case NodeKind::ND_EQ:
+    case NodeKind::ND_NE:
+    case NodeKind::ND_LT:
+    case NodeKind::ND_LE: {
+        int a = protect(gen_expr(cond->lhs), has_assign(cond->rhs));
+        int b = gen_expr(cond->rhs);
+        // 成り立たないときに飛ぶ場合は、逆の比較にする (!(a<b)はb<=a)
+        switch (cond->kind) {
+        case NodeKind::ND_EQ:
+            jump = emit(jump_if ? VMOp::JEQ : VMOp::JNE, 0, a, b);
+            break;
+        case NodeKind::ND_NE:
+            jump = emit(jump_if ? VMOp::JNE : VMOp::JEQ, 0, a, b);
+            break;
+        case NodeKind::ND_LT:
+            jump = jump_if ? emit(VMOp::JLT, 0, a, b) : emit(VMOp::JLE, 0, b, a);
+            break;
+        default:
+            jump = jump_if ? emit(VMOp::JLE, 0, a, b) : emit(VMOp::JLT, 0, b, a);
+            break;
+        }
+        break;
+    }
+    default:
+        jump = emit(jump_if ? VMOp::JNZ : VMOp::JZ, 0, gen_expr(cond));
+        break;
+    }
+    top = saved;
+    return jump;
+}
+
+static void gen_stmt(Node *node) {
+    if (!node)
+        return;
+    int saved = top;
+    switch (node->kind) {
+    case NodeKind::ND_RETURN:
+        emit(VMOp::RET, gen_expr(node->lhs));
+        break;
+    case NodeKind::ND_IF: {
+        size_t els = gen_branch(node->cond, false);
+        gen_stmt(node->then);
+        if (node->els) {
+            size_t end = emit(VMOp::JMP, 0);
+            patch(els);
+            gen_stmt(node->els);
+            patch(end);
+        } else {
+            patch(els);
+        }
+        break;
+    }
+    case NodeKind::ND_WHILE:
+    case NodeKind::ND_FOR: {
+        // 条件は本体の後ろに置き、1周ごとのジャンプを1回にする
+        if (node->init)
+            gen_expr(node->init);
+        top = saved;
+        size_t entry = node->cond ? emit(VMOp::JMP, 0) : 0;
+        size_t body = out->size();
+        gen_stmt(node->then);
+        if (node->inc)
+            gen_expr(node->inc);
+        top = saved;
+        if (node->cond) {
+            patch(entry);
+            (*out)[gen_branch(node->cond, true)].a = body;
+        } else {
+            emit(VMOp::JMP, body);
+        }
+        break;
+    }
+    case NodeKind::ND_BLOCK:
+        for (auto stmt : *(node->body))
+            gen_stmt(stmt);
+        break;
+    default:
+        gen_expr(node);
+        break;
+    }
+    top = saved;
+}
+
+VMProgram::VMProgram(const std::vector<Function> &prog) {
+    out = &code;
+    used_natives = &natives;
+    func_index.clear();
+    native_index.clear();
+    for (size_t i = 0; i < prog.size(); i++)
+        func_index[prog[i].name] = i;
+
+    for (auto &fn : prog) {
+        nvars = top = fn.stack_size / 8;
+        // 引数は呼び出し元が0番から順に置くので、変数が少なくてもその分のレジスタは要る
+        max_top = std::max(nvars, int(fn.params.size()));
+        size_t entry = out->size();
+
+        // -fshare-slotsで引数の変数が並び替わっていれば、置かれた場所から移す
+        // i番目の引数のスロットはi番以下なので、前から順に移せばまだ移していない引数を壊さない
+        // スロットを共有する引数では、最後の (使われる) ものが残る
+        for (size_t i = 0; i < fn.params.size(); i++)
+            if (var_reg(fn.params[i]) != int(i))
+                emit(VMOp::MOV, var_reg(fn.params[i]), i);
+
+        for (auto node : fn.code)
+            gen_stmt(node);
+
+        // returnせずに関数の終わりに到達した場合は0を返す
+        int r = new_reg();
+        emit(VMOp::MOVI, r, 0);
+        emit(VMOp::RET, r);
+        funcs.push_back(VMFunc{fn.name, entry, max_top});
+    }
+}
+
+static long call_args(const HostFunc &f, long *a) {
+    switch (f.nparams) {
+    case 0:
+        return reinterpret_cast<long (*)()>(f.addr)();
+    case 1:
+        return reinterpret_cast<long (*)(long)>(f.addr)(a[0]);
+    case 2:
+        return reinterpret_cast<long (*)(long, long)>(f.addr)(a[0], a[1]);
+    case 3:
+        return reinterpret_cast<long (*)(long, long, long)>(f.addr)(a[0], a[1], a[2]);
+    case 4:
+        return reinterpret_cast<long (*)(long, long, long, long)>(f.addr)(a[0], a[1], a[2], a[3]);
+    case 5:
+        return reinterpret_cast<long (*)(long, long, long, long, long)>(f.addr)(a[0], a[1], a[2], a[3], a[4]);
+    case 6:
+        return reinterpret_cast<long (*)(long, long, long, long, long, long)>(f.addr)(a[0], a[1], a[2], a[3],
+                                                                                      a[4], a[5]);
+    case 7:
+        return reinterpret_cast<long (*)(long, long, long, long, long, long, long)>(f.addr)(
+            a[0], a[1], a[2], a[3], a[4], a[5], a[6]);
+    default:
+        return reinterpret_cast<long (*)(long, long, long, long, long, long, long, long)>(f.addr)(
+            a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
+    }
+}
+
+static long call_host(const HostFunc &f, long *a) {
+    long ret = call_args(f, a);
+    // intを返す関数では、リンクしたネイティブのコードと同じくeaxに書いた値の上位32bitを0として読む
+    return f.ret_int ? long(uint32_t(ret)) : ret;
+}
+
+// レジスタのスタックの大きさ。触れたページだけが実際に確保される
+static const size_t stack_size = 1 << 23;
+
+long VMProgram::call(std::string_view name) const {
+    auto fn = std::find_if(funcs.begin(), funcs.end(), [&](const VMFunc &f) { return f.name == name; });
+    if (fn == funcs.end())
+        error("関数がありません: %.*s", int(name.size()), name.data());
+
+    std::unique_ptr<long[]> stack(new long[stack_size]);
+    long *end = stack.get() + stack_size;
+
+    // 呼び出し元に戻るための情報
+    struct Frame {
+        const VMInsn *pc;
+        long *base;
+    };
+    std::vector<Frame> frames;
+
+    const VMInsn *start = code.data();
+    const VMInsn *pc = start + fn->entry;
+    long *R = stack.get();
+    if (R + fn->nregs > end)
+        error("VMのスタックが溢れました");
+
+    // 命令ごとの処理に直接ジャンプする (VMOpと同じ順に並べる)
+    static void *labels[] = {&&op_movi, &&op_mov, &&op_add, &&op_addi, &&op_sub, &&op_mul, &&op_div,
+                             &&op_eq,   &&op_ne,  &&op_lt,  &&op_le,   &&op_jmp, &&op_jz,  &&op_jnz,
+                             &&op_jeq,  &&op_jne, &&op_jlt, &&op_jle,  &&op_call, &&op_calln, &&op_ret};
+#define DISPATCH() goto *labels[int(pc->op)]
+#define NEXT()                                                                                                         \
+    do {                                                                                                               \
+        pc++;                                                                                                          \
+        DISPATCH();                                                                                                    \
+    } while (0)
+#define JUMP_IF(cond)                                                                                                  \
+    do {                                                                                                               \
+        pc = (cond) ? start + pc->a : pc + 1;                                                                          \
+        DISPATCH();                                                                                                    \
+    } while (0)
+
+    DISPATCH();
+
+op_movi:
+    R[pc->a] = pc->b;
+    NEXT();
+op_mov:
+    R[pc->a] = R[pc->b];
+    NEXT();
+op_add:
+    R[pc->a] = R[pc->b] + R[pc->c];
+    NEXT();
+op_addi:
+    R[pc->a] = R[pc->b] + pc->c;
+    NEXT();
+op_sub:
+    R[pc->a] = R[pc->b] - R[pc->c];
+    NEXT();
+op_mul:
+    R[pc->a] = R[pc->b] * R[pc->c];
+    NEXT();
+op_div:
+    if (R[pc->c] == 0)
+        error("0で割りました");
+    R[pc->a] = R[pc->b] / R[pc->c];
+    NEXT();
+op_eq:
+    R[pc->a] = R[pc->b] == R[pc->c];
+    NEXT();
+op_ne:
+    R[pc->a] = R[pc->b] != R[pc->c];
+    NEXT();
+op_lt:
+    R[pc->a] = R[pc->b] < R[pc->c];
+    NEXT();
+op_le:
+    R[pc->a] = R[pc->b] <= R[pc->c];
+    NEXT();
+op_jmp:
+    pc = start + pc->a;
+    DISPATCH();
+op_jz:
+    JUMP_IF(!R[pc->b]);
+op_jnz:
+    JUMP_IF(R[pc->b]);
+op_jeq:
+    JUMP_IF(R[pc->b] == R[pc->c]);
+op_jne:
+    JUMP_IF(R[pc->b] != R[pc->c]);
+op_jlt:
+    JUMP_IF(R[pc->b] < R[pc->c]);
+op_jle:
+    JUMP_IF(R[pc->b] <= R[pc->c]);
+op_call: {
+    const VMFunc &f = funcs[pc->b];
+    long *base = R + pc->a;
+    if (base + f.nregs > end)
+        error("VMのスタックが溢れました");
+    frames.push_back(Frame{pc + 1, R});
+    R = base;
+    pc = start + f.entry;
+    DISPATCH();
+}
+op_calln:
+    R[pc->a] = call_host(natives[pc->b], R + pc->a);
+    NEXT();
+op_ret: {
+    // 戻り値はフレームの先頭、つまり呼び出し元のCALLのaに置く
+    long val = R[pc->a];
+    if (frames.empty())
+        return val;
+    R[0] = val;
+    pc = frames.back().pc;
+    R = frames.back().base;
+    frames.pop_back();
+    DISPATCH();
+}
+#undef DISPATCH
+#undef NEXT
+#undef JUMP_IF
+}